@@ -1,10 +1,21 @@
-// Compile debug:   clang -D DEBUG -O0 -g -o octarine octarine.c
-// Compile release: clang -D RELEASE -Ofast -o octarine octarine.c
+// Compile debug:   clang -D DEBUG -O0 -g -pthread -o octarine octarine.c
+// Compile release: clang -D RELEASE -Ofast -pthread -o octarine octarine.c
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 // TODO: Error type
 // TODO: make interpreter functions return void, should use stack!
@@ -16,28 +27,51 @@ typedef struct sEnvironment Environment;
 typedef struct sType Type;
 typedef struct sObject Object;
 typedef struct sStack Stack;
-typedef Object* (*BuiltInFn)(Context* ctx);
+typedef struct sHeapChunk HeapChunk;
+typedef struct sHeapMark HeapMark;
+typedef struct sTask Task;
+// Builtins with a fixed number of arguments of up to four get them passed
+// directly, variadic ones take their arguments from the stack.
+typedef Object* (*BuiltInFn)(Context* ctx, unsigned int nArgs);
+typedef Object* (*BuiltInFn0)(Context* ctx);
+typedef Object* (*BuiltInFn1)(Context* ctx, Object* a);
+typedef Object* (*BuiltInFn2)(Context* ctx, Object* a, Object* b);
+typedef Object* (*BuiltInFn3)(Context* ctx, Object* a, Object* b, Object* c);
+typedef Object* (*BuiltInFn4)(Context* ctx, Object* a, Object* b, Object* c, Object* d);
+typedef double (*NumberFn2)(double a, double b);
 typedef struct sError Error;
 typedef struct sStream Stream;
 typedef enum eStreamType StreamType;
 typedef struct sTokenizer Tokenizer;
 typedef struct sReader Reader;
+typedef struct sWriter Writer;
+typedef struct sInternEntry InternEntry;
+typedef struct sInternKey InternKey;
 
 // Language types (Move more runtime types here. Full reflection is nice.)
 typedef struct sNumber Number;
 typedef struct sSymbol Symbol;
 typedef struct sList List;
 typedef struct sFunction Function;
+typedef struct sTable Table;
+typedef struct sSeq Seq;
 
 // Runtime type definitions
+
+// A reference to an object stored inside another object, as an offset from
+// the start of the heap region. 0 is nil. See RefGet.
+typedef unsigned int Ref;
+
+// The header holds the mark bit in the lowest bit, the index of the object's
+// type in the type table in the next OBJECT_TYPE_BITS bits, and type specific
+// flags in the remaining bits.
 struct sObject {
-  Type* type;
-  Object* next;
-  unsigned int marked;
+  unsigned int header;
   char data[0];
 };
 
 struct sType {
+  unsigned int id; // Index in the type table, see TypeRegister
   unsigned int size;
   unsigned int alignment;
   char* name;
@@ -45,13 +79,52 @@ struct sType {
   Function* printFn;
   Function* evalFn;
   unsigned int nFields;
-  Type** fields;
+  Type** fields; // NULL for fields that hold an object reference
+  // Only set for record types, see RecordTypeNew
+  char** fieldNames;
+  unsigned int* offsets;
+  Type* next; // Next record type owned by the same context
 };
 
 struct sStack {
   unsigned int size;
   unsigned int top;
   Object** data;
+  char dataInHeap; // Set if data is in a context heap, see Spawn
+};
+
+// A green thread, running one form on its own C stack and value stack.
+// Runnable tasks form a ring through next and prev.
+struct sTask {
+  ucontext_t context;
+  Stack* stack;
+  Context* ctx;
+  Object* form;
+  Task* next;
+  Task* prev;
+};
+
+// Objects are bump allocated out of a chain of chunks owned by their context.
+// Every allocation in a chunk starts with an object header, so a chunk can be
+// walked from the start to its used size.
+struct sHeapChunk {
+  HeapChunk* next;
+  unsigned long long size;
+  unsigned long long used; // Only up to date for chunks before the current one
+  char data[0];
+};
+
+// A point in a context heap to rewind to, dropping everything allocated after
+// it. Also notes how much the context had bound, defined and read, as those
+// are what keeps objects alive past the form that made them. See HeapRewindForm.
+struct sHeapMark {
+  HeapChunk* chunk;
+  unsigned long long top;
+  unsigned int nFinalizable;
+  unsigned int nBindings;
+  Type* recordTypes;
+  unsigned int nSymbols;
+  unsigned int nInterned;
 };
 
 struct sRuntime {
@@ -60,17 +133,36 @@ struct sRuntime {
   Context** contexts;
   Context* currentContext;
   Environment* environment;
+  Context* freeContexts; // Pooled contexts, see RuntimeAcquireContext
+  unsigned int nBuiltIns;
+  unsigned int builtInListSize;
+  Object** builtIns;
+  HeapChunk* builtInHeap; // Holds the builtins, see RuntimeBindBuiltIn
 };
 
 struct sContext {
   Runtime* runtime;
   Environment* environment;
   Stack* stack;
-  Object* lastObject;
+  // Number of live objects whose type has a deleteFn. When there are none the
+  // heap can be dropped without walking it.
+  unsigned int nFinalizable;
   Reader* reader;
+  Writer* writer;
+  HeapChunk* heap;
+  HeapChunk* heapChunk; // Chunk currently allocated from
+  unsigned long long heapTop; // Allocation watermark within heapChunk
+  Context* nextFree;
+  Type* recordTypes; // Record types defined in this context
+  Task mainTask; // The context's own execution, the first task in the run queue
+  Task* currentTask;
+  unsigned int nTasks; // Spawned tasks that have not finished
+  unsigned int nWaiting; // Tasks other than the running one waiting for input
+  char* freeTaskStacks; // C stacks of finished tasks, see taskStackNew
 };
 
 struct sEnvironment {
+  unsigned int nBindings;
   unsigned int bindingsListSize;
   char** names;
   Object** objects;
@@ -83,7 +175,9 @@ struct sError {
 
 enum eStreamType {
   ST_STRING,
-  ST_FILE
+  ST_FILE,
+  ST_MAPPED, // File mapped into memory
+  ST_MEMORY // Memory owned by someone else
 };
 
 struct sStream {
@@ -91,9 +185,28 @@ struct sStream {
   union {
     struct {
       unsigned int stringPos;
+      unsigned int stringSize;
       char* string;
     };
-    FILE* file;
+    struct {
+      int fd;
+      unsigned int bufferPos;
+      unsigned int bufferEnd;
+      char* buffer;
+      char* nextBuffer; // Filled by the read in flight, see StreamFill
+      unsigned long long fileOffset;
+      int readResult;
+      char readPending;
+      char isRegular;
+      char polled; // Registered with epoll
+      char eof;
+      char busy;
+    };
+    struct {
+      unsigned long long mappedPos;
+      unsigned long long mappedSize;
+      char* mapped;
+    };
   };
 };
 
@@ -106,6 +219,45 @@ struct sTokenizer {
 
 struct sReader {
   Tokenizer* tokenizer;
+  char binary;
+  // Set if the input is a module cache, see ModuleCompile.
+  char hasSourceHash;
+  unsigned char cacheVersion;
+  unsigned long long sourceHash;
+  // When set, identical literals read by this reader share one object. See makeNumber.
+  char intern;
+  unsigned int nInterned;
+  unsigned int internTableSize;
+  InternEntry* internTable;
+  // Symbols seen so far in a binary input, indexed by their order of definition.
+  unsigned int nSymbols;
+  unsigned int symbolListSize;
+  Object** symbols;
+};
+
+struct sInternEntry {
+  unsigned long long hash;
+  Object* object;
+};
+
+// Describes an object to look up in an intern table before it is allocated.
+struct sInternKey {
+  Type* type;
+  double number;
+  const char* name;
+  Object* value;
+  Object* next;
+};
+
+struct sWriter {
+  FILE* file;
+  // Symbol names written so far, indexed by their order of definition.
+  unsigned int nSymbols;
+  unsigned int symbolListSize;
+  char** symbols;
+  // Open addressing hash table from name to index + 1 in symbols, 0 if empty.
+  unsigned int symbolTableSize;
+  unsigned int* symbolTable;
 };
 
 // Language type definitions
@@ -119,28 +271,172 @@ struct sSymbol {
 };
 
 struct sList {
-  Object* value;
-  Object* next;
+  Ref value;
+  Ref next;
 };
 
 struct sFunction {
   char* name;
   char isBuiltIn;
+  int arity; // Number of arguments, or ARITY_VARIADIC
   union {
-    BuiltInFn builtIn;
+    BuiltInFn builtIn; // Variadic entry point
+    BuiltInFn0 fn0;
+    BuiltInFn1 fn1;
+    BuiltInFn2 fn2;
+    BuiltInFn3 fn3;
+    BuiltInFn4 fn4;
     Object* code;
   };
+  // Unboxed version of a two argument builtin on numbers, used by call sites
+  // that have only seen numbers. May be NULL.
+  NumberFn2 numberFn;
+  // Special forms get the unevaluated call form as their only argument.
+  char isSpecial;
+  // Set for builtins without side effects whose result depends only on their
+  // arguments, so that calls with constant arguments can be folded.
+  char isPure;
+  // Set for record constructors and field accessors, see RecordTypeNew.
+  Type* recordType;
+  int field; // Field read by an accessor, or -1 for a constructor
+};
+
+struct sTable {
+  Type* recordType;
+  unsigned int nRows;
+  unsigned int capacity;
+  char** columns;
+};
+
+// Lazy sequences produce their elements one at a time, see seqNext. A
+// SEQ_READ sequence reads forms from a file, the others transform the
+// elements of their source sequence.
+struct sSeq {
+  char kind;
+  Reader* reader;   // SEQ_READ
+  Object* source;
+  Function* fn;     // SEQ_MAP and SEQ_FILTER
+  double remaining; // SEQ_TAKE
 };
 
 // All of globals
 
+// Size of the blocks ST_FILE streams read. Input is pulled in blocks of this
+// size so that reading a file does not cost a syscall for every character.
+#define STREAM_BUFFER_SIZE 65536
+
+// Event loop that ST_FILE streams read through, see StreamFill.
+#define IO_RING_ENTRIES 256
+
+typedef struct {
+  char initialized;
+  int ringFd; // -1 if io_uring is not available
+  int epollFd;
+  unsigned int nQueued; // Entries queued but not yet submitted
+  unsigned int sqEntries;
+  unsigned int* sqHead;
+  unsigned int* sqTail;
+  unsigned int* sqMask;
+  unsigned int* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned int* cqHead;
+  unsigned int* cqTail;
+  unsigned int* cqMask;
+  struct io_uring_cqe* cqes;
+  unsigned long long nCompleted; // Reads completed so far
+  Context* ctx; // Context running on this thread, whose tasks a blocked read lets run
+} IoLoop;
+
+static __thread IoLoop ioLoop;
+
+// Minimum size of a context heap chunk.
+#define HEAP_CHUNK_SIZE (1024 * 1024)
+
+// Every heap chunk is carved out of a single address range reserved when the
+// first runtime is created, so that objects can refer to each other with 32
+// bit offsets from its start. Only the chunks handed out are ever committed.
+#define HEAP_REGION_SIZE (4ull * 1024 * 1024 * 1024)
+
+// Alignment of every allocation in a context heap. No type may require more.
+#define HEAP_ALIGNMENT 8
+
+#define OBJECT_MARK 1
+#define OBJECT_TYPE_BITS 27
+#define OBJECT_FLAGS_SHIFT (OBJECT_TYPE_BITS + 1)
+
+// Lists keep type feedback for the call they represent in their header flags.
+// A call to a builtin with a numeric fast path counts how often it saw only
+// number arguments, and after SITE_HOT_COUNT such calls it is specialised to
+// SITE_NUMBER. A call that sees anything else becomes SITE_GENERIC for good.
+#define SITE_HOT_COUNT 2
+#define SITE_NUMBER 14
+#define SITE_GENERIC 15
+
+#define ARITY_VARIADIC -1
+
+// Size of the C stack of a task, which bounds how deeply the form it runs
+// can nest, and the initial size of its value stack. Stack pages are only
+// committed once they are used. Calls stop nesting TASK_STACK_RESERVE bytes
+// before the end of the C stack, anything nesting deeper runs into the guard
+// page below it and crashes rather than overwriting memory.
+#define TASK_STACK_SIZE (256 * 1024)
+#define TASK_STACK_RESERVE (16 * 1024)
+#define TASK_VALUE_STACK_SIZE 16
+
+// Type id 0 is not a type, it marks raw memory blocks allocated with
+// ContextAlloc. Their size follows the header.
+#define TYPE_ID_RAW 0
+#define MAX_TYPES (1u << OBJECT_TYPE_BITS)
+
+// Type table, indexed by type id. It grows as types are registered.
+static Type** types;
+static unsigned int typeTableSize;
+
+// Heap region, see HEAP_REGION_SIZE
+static char* heapRegion;
+static unsigned long long heapRegionTop;
+static HeapChunk* heapFreeChunks; // Chunks of deleted contexts
+static pthread_mutex_t heapRegionLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Binary format for serialized data. A file starts with the magic bytes and a
+// version byte, followed by any number of encoded objects. Every object starts
+// with one of the tag bytes below:
+//   BT_NUMBER        8 byte little endian IEEE double
+//   BT_INTEGER       number with an integral value, zigzag encoded
+//   BT_SYMBOL_DEF    length followed by the name; adds it to the symbol table
+//   BT_SYMBOL_REF    index into the symbol table
+//   BT_LIST          element count followed by the elements
+// Lengths, counts, indexes and integers are unsigned LEB128 varints.
+#define BINARY_MAGIC "OCTB"
+#define BINARY_MAGIC_SIZE 4
+#define BINARY_VERSION 1
+
+// A module cache file is a binary file prefixed with the cache magic, the
+// cache version and the 8 byte little endian hash of the source it was
+// compiled from. Bump the cache version whenever the reader changes the forms
+// it produces for a source, so that caches written before are rebuilt.
+#define CACHE_MAGIC "OCTC"
+#define CACHE_MAGIC_SIZE 4
+#define CACHE_VERSION 1
+
+#define BT_NUMBER 'N'
+#define BT_INTEGER 'I'
+#define BT_SYMBOL_DEF 's'
+#define BT_SYMBOL_REF 'S'
+#define BT_LIST 'L'
+
 static Type tNumber;
 static Type tSymbol;
 static Type tList;
 static Type tFunction;
+static Type tTable;
+static Type tSeq;
 
 // All of functions
 
+static void ioLoopInit(void);
+static void streamCancelRead(Stream* s);
+
 static Stream* StreamNew(StreamType type, const char* strOrFileName) {
   Stream* s = (Stream*)malloc(sizeof(Stream));
   if(!s) {
@@ -152,6 +448,7 @@ static Stream* StreamNew(StreamType type, const char* strOrFileName) {
   if(type == ST_STRING) {
     unsigned int len = strlen(strOrFileName);
     s->stringPos = 0;
+    s->stringSize = len + 1;
     s->string = (char*)malloc(len + 1);
     if(!s->string) {
       goto cleanup;
@@ -160,10 +457,54 @@ static Stream* StreamNew(StreamType type, const char* strOrFileName) {
     s->string[len] = 0;
   }
   else if(type == ST_FILE) {
-    s->file = fopen(strOrFileName, "rb");
-    if(!s->file) {
+    ioLoopInit();
+    s->bufferPos = 0;
+    s->bufferEnd = 0;
+    s->fileOffset = 0;
+    s->readPending = 0;
+    s->polled = 0;
+    s->eof = 0;
+    s->busy = 0;
+    s->buffer = (char*)malloc(STREAM_BUFFER_SIZE * 2);
+    if(!s->buffer) {
+      goto cleanup;
+    }
+    s->nextBuffer = s->buffer + STREAM_BUFFER_SIZE;
+    s->fd = open(strOrFileName, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(s->fd == -1 || fstat(s->fd, &st) != 0) {
+      if(s->fd != -1) {
+        close(s->fd);
+      }
+      free(s->buffer);
+      goto cleanup;
+    }
+    s->isRegular = S_ISREG(st.st_mode);
+    if(!s->isRegular && ioLoop.ringFd == -1) {
+      fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+    }
+  }
+  else if(type == ST_MAPPED) {
+    int fd = open(strOrFileName, O_RDONLY);
+    if(fd == -1) {
       goto cleanup;
     }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      close(fd);
+      goto cleanup;
+    }
+    s->mappedPos = 0;
+    s->mappedSize = st.st_size;
+    s->mapped = NULL;
+    if(s->mappedSize > 0) {
+      s->mapped = mmap(NULL, s->mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(s->mapped == MAP_FAILED) {
+        close(fd);
+        goto cleanup;
+      }
+    }
+    close(fd);
   }
   else {
     goto cleanup;
@@ -179,19 +520,66 @@ static Stream* StreamNew(StreamType type, const char* strOrFileName) {
   return s;
 }
 
+// Releases what the stream holds on to, leaving it without input.
+static void streamClose(Stream* s) {
+  if(s->type == ST_STRING) {
+    free(s->string);
+  }
+  else if(s->type == ST_FILE) {
+    streamCancelRead(s);
+    if(s->polled) {
+      epoll_ctl(ioLoop.epollFd, EPOLL_CTL_DEL, s->fd, NULL);
+    }
+    close(s->fd);
+    // The two blocks are one allocation, starting at whichever comes first.
+    free(s->buffer < s->nextBuffer ? s->buffer : s->nextBuffer);
+  }
+  else if(s->type == ST_MAPPED) {
+    if(s->mapped) {
+      munmap(s->mapped, s->mappedSize);
+    }
+  }
+}
+
 static void StreamDelete(Stream* stream) {
   if(!stream) {
     return;
   }
 
-  if(stream->type == ST_STRING) {
-    free(stream->string);
+  streamClose(stream);
+  free(stream);
+}
+
+// Points an existing stream at a new string, reusing the string buffer when it
+// is large enough.
+static int StreamSetString(Stream* s, const char* str) {
+  unsigned int len = strlen(str);
+  if(s->type != ST_STRING) {
+    streamClose(s);
+    s->type = ST_STRING;
+    s->stringSize = 0;
+    s->string = NULL;
   }
-  else if(stream->type == ST_FILE) {
-    fclose(stream->file);
+  if(len + 1 > s->stringSize) {
+    char* newString = (char*)realloc(s->string, len + 1);
+    if(!newString) {
+      return 0;
+    }
+    s->stringSize = len + 1;
+    s->string = newString;
   }
+  memcpy(s->string, str, len + 1);
+  s->stringPos = 0;
+  return 1;
+}
 
-  free(stream);
+// Points an existing stream at size bytes of memory, which must outlive it.
+static void StreamSetMemory(Stream* s, const char* data, unsigned long long size) {
+  streamClose(s);
+  s->type = ST_MEMORY;
+  s->mappedPos = 0;
+  s->mappedSize = size;
+  s->mapped = (char*)data;
 }
 
 static Tokenizer* TokenizerNew(StreamType inputType, const char* strOrFileName) {
@@ -237,30 +625,165 @@ static void TokenizerDelete(Tokenizer* tokenizer) {
   free(tokenizer);
 }
 
+static int StreamSkipPrefix(Stream* s, const char* prefix, unsigned int len);
+static unsigned int StreamRead(Stream* s, char* dest, unsigned int len);
+static int StreamGet(Stream* s);
+
+static unsigned long long decodeU64(const unsigned char* bytes) {
+  unsigned long long value = 0;
+  for(int i = 7; i >= 0; --i) {
+    value = (value << 8) | bytes[i];
+  }
+  return value;
+}
+
+static void encodeU64(unsigned long long value, unsigned char* bytes) {
+  for(int i = 0; i < 8; ++i) {
+    bytes[i] = (value >> (i * 8)) & 0xff;
+  }
+}
+
+// Reads the cache header and binary magic, if any, at the start of the
+// reader's stream. Returns 0 if the input can not be read.
+static int readerReadPrefix(Reader* r) {
+  Stream* stream = r->tokenizer->stream;
+  r->hasSourceHash = StreamSkipPrefix(stream, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+  if(r->hasSourceHash) {
+    unsigned char bytes[9];
+    if(StreamRead(stream, (char*)bytes, 9) != 9) {
+      return 0;
+    }
+    r->cacheVersion = bytes[0];
+    r->sourceHash = decodeU64(bytes + 1);
+  }
+
+  r->binary = StreamSkipPrefix(stream, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+  if(r->binary && StreamGet(stream) != BINARY_VERSION) {
+    fputs("Unsupported binary format version.\n", stderr);
+    return 0;
+  }
+  return 1;
+}
+
 static Reader* ReaderNew(StreamType inputType, const char* strOrFileName) {
   Reader* r = (Reader*)malloc(sizeof(Reader));
   if(!r) {
     return NULL;
   }
 
+  r->nSymbols = 0;
+  r->symbolListSize = 0;
+  r->symbols = NULL;
+  r->intern = 0;
+  r->nInterned = 0;
+  r->internTableSize = 0;
+  r->internTable = NULL;
+
   r->tokenizer = TokenizerNew(inputType, strOrFileName);
   if(!r->tokenizer) {
     free(r);
     return NULL;
   }
 
+  if(!readerReadPrefix(r)) {
+    TokenizerDelete(r->tokenizer);
+    free(r);
+    return NULL;
+  }
+
   return r;
 }
 
+// Starts reading the reader's stream over from its current position.
+static int readerRestart(Reader* r) {
+  Tokenizer* t = r->tokenizer;
+  t->c = ' ';
+  t->token[0] = 0;
+  r->nSymbols = 0;
+  r->nInterned = 0;
+  for(unsigned int i = 0; i < r->internTableSize; ++i) {
+    r->internTable[i].object = NULL;
+  }
+  return readerReadPrefix(r);
+}
+
+// Rebinds the reader to read from a string, keeping its buffers.
+static int ReaderReset(Reader* r, const char* str) {
+  if(!StreamSetString(r->tokenizer->stream, str)) {
+    return 0;
+  }
+  return readerRestart(r);
+}
+
+// Rebinds the reader to read from memory owned by the caller.
+static int ReaderSetMemory(Reader* r, const char* data, unsigned long long size) {
+  StreamSetMemory(r->tokenizer->stream, data, size);
+  return readerRestart(r);
+}
+
 static void ReaderDelete(Reader* reader) {
   if(!reader) {
     return;
   }
 
   TokenizerDelete(reader->tokenizer);
+  free(reader->symbols);
+  free(reader->internTable);
   free(reader);
 }
 
+// If sourceHash is given the file is written as a module cache for source
+// with that hash.
+static Writer* WriterNew(const char* fileName, const unsigned long long* sourceHash) {
+  Writer* w = (Writer*)malloc(sizeof(Writer));
+  if(!w) {
+    return NULL;
+  }
+
+  w->nSymbols = 0;
+  w->symbolListSize = 0;
+  w->symbols = NULL;
+  w->symbolTableSize = 0;
+  w->symbolTable = NULL;
+
+  w->file = fopen(fileName, "wb");
+  if(!w->file) {
+    free(w);
+    return NULL;
+  }
+
+  if(sourceHash) {
+    unsigned char bytes[9];
+    bytes[0] = CACHE_VERSION;
+    encodeU64(*sourceHash, bytes + 1);
+    fwrite(CACHE_MAGIC, 1, CACHE_MAGIC_SIZE, w->file);
+    fwrite(bytes, 1, 9, w->file);
+  }
+  fwrite(BINARY_MAGIC, 1, BINARY_MAGIC_SIZE, w->file);
+  fputc(BINARY_VERSION, w->file);
+
+  return w;
+}
+
+// Closes the writer's file. Returns 0 if anything written could not be stored.
+static int WriterDelete(Writer* writer) {
+  if(!writer) {
+    return 1;
+  }
+
+  for(unsigned int i = 0; i < writer->nSymbols; ++i) {
+    free(writer->symbols[i]);
+  }
+  free(writer->symbols);
+  free(writer->symbolTable);
+  int ok = !ferror(writer->file);
+  if(fclose(writer->file) != 0) {
+    ok = 0;
+  }
+  free(writer);
+  return ok;
+}
+
 static Environment* EnvironmentNew(Environment* parent) {
   Environment* env = (Environment*)malloc(sizeof(Environment));
   if(!env) {
@@ -268,6 +791,7 @@ static Environment* EnvironmentNew(Environment* parent) {
   }
 
   env->parent = parent;
+  env->nBindings = 0;
   env->bindingsListSize = 100;
 
   env->names = (char**)malloc(sizeof(char*) * env->bindingsListSize);
@@ -311,6 +835,17 @@ static void EnvironmentDelete(Environment* env) {
   free(env);
 }
 
+// Removes all bindings.
+static void EnvironmentClear(Environment* env) {
+  for(unsigned int i = 0; env->nBindings > 0 && i < env->bindingsListSize; ++i) {
+    if(env->names[i]) {
+      free(env->names[i]);
+      env->names[i] = NULL;
+      --env->nBindings;
+    }
+  }
+}
+
 static Stack* StackNew() {
   Stack* s = (Stack*)malloc(sizeof(Stack));
   if(!s) {
@@ -319,6 +854,7 @@ static Stack* StackNew() {
 
   s->size = 1000;
   s->top = 0;
+  s->dataInHeap = 0;
   s->data = (Object**)malloc(sizeof(Object*) * s->size);
   if(!s->data) {
     free(s);
@@ -336,14 +872,144 @@ static void StackDelete(Stack* s) {
   free(s);
 }
 
+static int heapRegionReserve(void) {
+  if(heapRegion) {
+    return 1;
+  }
+  void* region = mmap(NULL, HEAP_REGION_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(region == MAP_FAILED) {
+    return 0;
+  }
+  heapRegion = region;
+  return 1;
+}
+
+static unsigned long long alignOffset(unsigned long long offset, unsigned long long on);
+
+// Returns a chunk with room for at least minSize bytes, reusing a chunk given
+// back by a deleted context when one is large enough. Chunks may be taken by
+// several threads at once.
+static HeapChunk* HeapChunkNew(unsigned long long minSize) {
+  unsigned long long size = minSize > HEAP_CHUNK_SIZE ? minSize : HEAP_CHUNK_SIZE;
+  size = alignOffset(sizeof(HeapChunk) + size, sysconf(_SC_PAGESIZE));
+  HeapChunk* chunk = NULL;
+  pthread_mutex_lock(&heapRegionLock);
+  for(HeapChunk** link = &heapFreeChunks; *link; link = &(*link)->next) {
+    if((*link)->size + sizeof(HeapChunk) >= size) {
+      chunk = *link;
+      *link = chunk->next;
+      break;
+    }
+  }
+  if(!chunk && heapRegionTop + size <= HEAP_REGION_SIZE &&
+     mprotect(heapRegion + heapRegionTop, size, PROT_READ | PROT_WRITE) == 0) {
+    chunk = (HeapChunk*)(heapRegion + heapRegionTop);
+    chunk->size = size - sizeof(HeapChunk);
+    heapRegionTop += size;
+  }
+  pthread_mutex_unlock(&heapRegionLock);
+  if(!chunk) {
+    return NULL;
+  }
+  chunk->next = NULL;
+  chunk->used = 0;
+  return chunk;
+}
+
+// Gives a chain of chunks back to the region for reuse. Their memory is
+// released to the system until then.
+static void HeapChunkDelete(HeapChunk* chunk) {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  while(chunk) {
+    HeapChunk* next = chunk->next;
+    madvise((char*)chunk + pageSize, sizeof(HeapChunk) + chunk->size - pageSize, MADV_DONTNEED);
+    pthread_mutex_lock(&heapRegionLock);
+    chunk->next = heapFreeChunks;
+    heapFreeChunks = chunk;
+    pthread_mutex_unlock(&heapRegionLock);
+    chunk = next;
+  }
+}
+
+// Returns the object a reference refers to.
+static Object* RefGet(Ref ref) {
+  return ref ? (Object*)(heapRegion + ref) : NULL;
+}
+
+// Returns a reference to an object, which must live in the heap region.
+static Ref RefMake(Object* o) {
+  if(!o) {
+    return 0;
+  }
+  assert((char*)o > heapRegion && (char*)o < heapRegion + HEAP_REGION_SIZE);
+  return (Ref)((char*)o - heapRegion);
+}
+
+// Bump allocates size bytes, rounded up to HEAP_ALIGNMENT, from the context heap.
+static void* HeapAlloc(Context* ctx, unsigned long long size) {
+  HeapChunk* chunk = ctx->heapChunk;
+  size = alignOffset(size, HEAP_ALIGNMENT);
+  if(ctx->heapTop + size > chunk->size) {
+    // Move on to the next chunk, reusing chunks left over from before a reset.
+    chunk->used = ctx->heapTop;
+    if(!chunk->next || chunk->next->size < size) {
+      HeapChunk* newChunk = HeapChunkNew(size);
+      if(!newChunk) {
+        return NULL;
+      }
+      newChunk->next = chunk->next;
+      chunk->next = newChunk;
+    }
+    chunk = chunk->next;
+    ctx->heapChunk = chunk;
+    ctx->heapTop = 0;
+  }
+  void* result = &chunk->data[ctx->heapTop];
+  ctx->heapTop += size;
+  return result;
+}
+
+// Returns size bytes of memory owned by the context, aligned to
+// HEAP_ALIGNMENT, or NULL if out of memory. The memory lives until the
+// context is reset or deleted.
+static void* ContextAlloc(Context* ctx, unsigned long long size) {
+  unsigned int* block = HeapAlloc(ctx, HEAP_ALIGNMENT + size);
+  if(!block) {
+    return NULL;
+  }
+  block[0] = TYPE_ID_RAW << 1;
+  block[1] = size;
+  return (char*)block + HEAP_ALIGNMENT;
+}
+
 static Context* ContextNew(Runtime* rt, StreamType inputType, const char* strOrFileName) {
   Context* ctx = (Context*)malloc(sizeof(Context));
   if(!ctx) {
     return NULL;
   }
   ctx->runtime = rt;
-  ctx->lastObject = NULL;
+  ctx->nFinalizable = 0;
+  ctx->environment = NULL;
   ctx->stack = NULL;
+  ctx->reader = NULL;
+  ctx->writer = NULL;
+  ctx->nextFree = NULL;
+  ctx->recordTypes = NULL;
+  ctx->heapTop = 0;
+  ctx->mainTask.next = &ctx->mainTask;
+  ctx->mainTask.prev = &ctx->mainTask;
+  ctx->mainTask.ctx = ctx;
+  ctx->currentTask = &ctx->mainTask;
+  ctx->nTasks = 0;
+  ctx->nWaiting = 0;
+  ctx->freeTaskStacks = NULL;
+
+  ctx->heap = HeapChunkNew(HEAP_CHUNK_SIZE);
+  ctx->heapChunk = ctx->heap;
+  if(!ctx->heap) {
+    goto cleanup;
+  }
 
   ctx->environment = EnvironmentNew(rt->environment);
   if(!ctx->environment) {
@@ -354,6 +1020,7 @@ static Context* ContextNew(Runtime* rt, StreamType inputType, const char* strOrF
   if(!ctx->stack) {
     goto cleanup;
   }
+  ctx->mainTask.stack = ctx->stack;
 
   ctx->reader = ReaderNew(inputType, strOrFileName);
   if(!ctx->reader) {
@@ -366,6 +1033,8 @@ static Context* ContextNew(Runtime* rt, StreamType inputType, const char* strOrF
   if(ctx) {
     EnvironmentDelete(ctx->environment);
     StackDelete(ctx->stack);
+    free(ctx->heap);
+    free(ctx);
     ctx = NULL;
   }
 
@@ -375,8 +1044,18 @@ static Context* ContextNew(Runtime* rt, StreamType inputType, const char* strOrF
 
 static void StackPush(Stack* s, Object* value) {
   if(s->top == s->size) {
-    unsigned int newSize = s->size;
-    Object** newData = (Object**)realloc(s->data, sizeof(Object*) * newSize);
+    unsigned int newSize = s->size * 2;
+    Object** newData;
+    if(s->dataInHeap) {
+      newData = (Object**)malloc(sizeof(Object*) * newSize);
+      if(newData) {
+        memcpy(newData, s->data, sizeof(Object*) * s->size);
+        s->dataInHeap = 0;
+      }
+    }
+    else {
+      newData = (Object**)realloc(s->data, sizeof(Object*) * newSize);
+    }
     if(!newData) {
       // TODO: return error here instead.
       fputs("realloc failed", stderr);
@@ -388,32 +1067,166 @@ static void StackPush(Stack* s, Object* value) {
   s->data[s->top++] = value;
 }
 
+static Type* ObjectGetType(Object* o) {
+  return types[(o->header >> 1) & (MAX_TYPES - 1)];
+}
+
+static unsigned int ObjectGetFlags(Object* o) {
+  return o->header >> OBJECT_FLAGS_SHIFT;
+}
+
+static void ObjectSetFlags(Object* o, unsigned int flags) {
+  o->header = (o->header & ((1u << OBJECT_FLAGS_SHIFT) - 1)) | (flags << OBJECT_FLAGS_SHIFT);
+}
+
+// Size of an object of the given type, including header and padding.
+static unsigned long long ObjectSize(Type* type) {
+  return alignOffset(alignOffset(sizeof(Object), type->alignment) + type->size, HEAP_ALIGNMENT);
+}
+
+// Gives the type an id so that objects can refer to it from their header.
+static void TypeRegister(Type* type) {
+  assert(type->alignment <= HEAP_ALIGNMENT);
+  unsigned int i = TYPE_ID_RAW + 1;
+  while(i < typeTableSize && types[i]) {
+    ++i;
+  }
+  if(i >= typeTableSize) {
+    unsigned int newSize = typeTableSize ? typeTableSize * 2 : 64;
+    Type** newTypes = newSize <= MAX_TYPES ? (Type**)realloc(types, sizeof(Type*) * newSize) : NULL;
+    if(!newTypes) {
+      abort(); // TODO: return error
+    }
+    memset(newTypes + typeTableSize, 0, sizeof(Type*) * (newSize - typeTableSize));
+    types = newTypes;
+    typeTableSize = newSize;
+  }
+  type->id = i;
+  types[i] = type;
+}
+
+static void TypeUnregister(Type* type) {
+  types[type->id] = NULL;
+}
+
 static void ObjectDelete(Context* ctx, Object* o) {
-  if(o->type->deleteFn) {
-    StackPush(ctx->stack, o);
-    o->type->deleteFn->builtIn(ctx);
+  if(ObjectGetType(o)->deleteFn) {
+    ObjectGetType(o)->deleteFn->fn1(ctx, o);
+  }
+}
+
+// Calls ObjectDelete on every object in the context heap from pos in chunk
+// onwards that needs it.
+static void heapFinalizeFrom(Context* ctx, HeapChunk* chunk, unsigned long long pos) {
+  for(; chunk; chunk = chunk->next, pos = 0) {
+    unsigned long long end = chunk == ctx->heapChunk ? ctx->heapTop : chunk->used;
+    while(pos < end) {
+      Object* o = (Object*)&chunk->data[pos];
+      if(((o->header >> 1) & (MAX_TYPES - 1)) == TYPE_ID_RAW) {
+        pos += alignOffset(HEAP_ALIGNMENT + ((unsigned int*)o)[1], HEAP_ALIGNMENT);
+      }
+      else {
+        ObjectDelete(ctx, o);
+        pos += ObjectSize(ObjectGetType(o));
+      }
+    }
+    if(chunk == ctx->heapChunk) {
+      break;
+    }
+  }
+}
+
+// Calls ObjectDelete on every object in the context heap that needs it.
+static void HeapFinalize(Context* ctx) {
+  if(ctx->nFinalizable == 0) {
+    return;
+  }
+  heapFinalizeFrom(ctx, ctx->heap, 0);
+  ctx->nFinalizable = 0;
+}
+
+// Marks the current top of the context heap. r is the reader the context is
+// reading its input from, if any.
+static void HeapMarkSet(Context* ctx, Reader* r, HeapMark* mark) {
+  mark->chunk = ctx->heapChunk;
+  mark->top = ctx->heapTop;
+  mark->nFinalizable = ctx->nFinalizable;
+  mark->nBindings = ctx->environment->nBindings;
+  mark->recordTypes = ctx->recordTypes;
+  mark->nSymbols = r ? r->nSymbols : 0;
+  mark->nInterned = r ? r->nInterned : 0;
+}
+
+// Drops every object allocated since the mark. The caller must know that
+// nothing still refers to them.
+static void HeapRewind(Context* ctx, HeapMark* mark) {
+  if(ctx->nFinalizable > mark->nFinalizable) {
+    heapFinalizeFrom(ctx, mark->chunk, mark->top);
+    ctx->nFinalizable = mark->nFinalizable;
+  }
+  ctx->heapChunk = mark->chunk;
+  ctx->heapTop = mark->top;
+}
+
+// Rewinds the heap to a mark set before reading and evaluating a form, unless
+// the form left something behind that may refer to its objects: a binding, a
+// record type, a symbol the reader will refer back to, or an interned literal.
+// Nothing is rewound while there are tasks, as they allocate from the same heap.
+// Without this everything read from a stream would stay alive until the
+// context is deleted. Returns whether the heap was rewound.
+static int HeapRewindForm(Context* ctx, Reader* r, HeapMark* mark) {
+  if(ctx->nTasks || ctx->environment->nBindings != mark->nBindings || ctx->recordTypes != mark->recordTypes ||
+     (r && (r->nSymbols != mark->nSymbols || r->nInterned != mark->nInterned))) {
+    return 0;
   }
+  HeapRewind(ctx, mark);
+  return 1;
 }
 
+static void taskStacksDelete(Context* ctx);
+
 static void ContextDelete(Context* ctx) {
   if(!ctx) {
     return;
   }
 
-  Object* current = ctx->lastObject;
-  while(current) {
-    Object* next = current->next;
-    ObjectDelete(ctx, current);
-    free(current);
-    current = next;
+  HeapFinalize(ctx);
+  for(Type* type = ctx->recordTypes; type; type = type->next) {
+    TypeUnregister(type);
   }
+  if(ioLoop.ctx == ctx) {
+    ioLoop.ctx = NULL;
+  }
+  taskStacksDelete(ctx);
+
+  HeapChunkDelete(ctx->heap);
 
   EnvironmentDelete(ctx->environment);
   StackDelete(ctx->stack);
   ReaderDelete(ctx->reader);
+  WriterDelete(ctx->writer);
   free(ctx);
 }
 
+// Makes the context ready to evaluate new input read from str, as if it had
+// just been created. All objects allocated in the context are released by
+// rewinding the heap; its memory is kept for reuse. Returns 0 on failure.
+static int ContextReset(Context* ctx, const char* str) {
+  HeapFinalize(ctx);
+  for(Type* type = ctx->recordTypes; type; type = type->next) {
+    TypeUnregister(type);
+  }
+  ctx->recordTypes = NULL;
+  ctx->heapChunk = ctx->heap;
+  ctx->heapTop = 0;
+  ctx->stack->top = 0;
+  EnvironmentClear(ctx->environment);
+  WriterDelete(ctx->writer);
+  ctx->writer = NULL;
+
+  return ReaderReset(ctx->reader, str);
+}
+
 static Object* StackPop(Stack* s) {
   if(s->top == 0) {
     // TODO: Error here!
@@ -430,26 +1243,15 @@ static unsigned long long alignOffset(unsigned long long offset, unsigned long l
 
 static void* ObjectGetDataPtr(Object* o) {
   unsigned long long offset = (unsigned long long) &o->data[0];
-  unsigned long long dataLocation = alignOffset(offset, o->type->alignment);
+  unsigned long long dataLocation = alignOffset(offset, ObjectGetType(o)->alignment);
   return (void*) dataLocation;
 }
 
 static int SymbolP(Object* o) {
-  return o->type == &tSymbol;
-}
-
-static Object* SymbolDelete(Context* ctx) {
-  Object* o = StackPop(ctx->stack);
-  if(!SymbolP(o)) {
-    abort(); // TODO: return error
-  }
-  Symbol* s = ObjectGetDataPtr(o);
-  free(s->name);
-  return NULL;
+  return ObjectGetType(o) == &tSymbol;
 }
 
-static Object* SymbolPrint(Context* ctx) {
-  Object* o = StackPop(ctx->stack);
+static Object* SymbolPrint(Context* ctx, Object* o) {
   if(!SymbolP(o)) {
     abort(); // TODO: return error
   }
@@ -459,9 +1261,9 @@ static Object* SymbolPrint(Context* ctx) {
 }
 
 static Object* EnvironmentGet(Context* ctx, Symbol* name);
+static Object* EnvironmentBind(Environment* env, const char* name, Object* obj);
 
-static Object* SymbolEval(Context* ctx) {
-  Object* o = StackPop(ctx->stack);
+static Object* SymbolEval(Context* ctx, Object* o) {
   if(!SymbolP(o)) {
     abort(); // TODO: error
   }
@@ -469,16 +1271,26 @@ static Object* SymbolEval(Context* ctx) {
   return EnvironmentGet(ctx, s);
 }
 
-static Function fSymbolDelete;
 static Function fSymbolPrint;
 static Function fSymbolEval;
 
+static Object* ObjectAllocRaw(Context* ctx, Type* type);
+
 static int NumberP(Object* o) {
-  return o->type == &tNumber;
+  return ObjectGetType(o) == &tNumber;
+}
+
+static Object* NumberNew(Context* ctx, double value) {
+  Object* o = ObjectAllocRaw(ctx, &tNumber);
+  if(!o) {
+    abort(); // TODO: return error
+  }
+  Number* n = ObjectGetDataPtr(o);
+  n->value = value;
+  return o;
 }
 
-static Object* NumberPrint(Context* ctx) {
-  Object* o = StackPop(ctx->stack);
+static Object* NumberPrint(Context* ctx, Object* o) {
   if(!NumberP(o)) {
     abort(); // TODO: return error
   }
@@ -489,29 +1301,77 @@ static Object* NumberPrint(Context* ctx) {
 
 static Function fNumberPrint;
 
+static double numberValue(Object* o) {
+  if(!o || !NumberP(o)) {
+    abort(); // TODO: return error
+  }
+  return ((Number*)ObjectGetDataPtr(o))->value;
+}
+
+static double addDoubles(double a, double b) {
+  return a + b;
+}
+
+static double subDoubles(double a, double b) {
+  return a - b;
+}
+
+static double mulDoubles(double a, double b) {
+  return a * b;
+}
+
+static double divDoubles(double a, double b) {
+  return a / b;
+}
+
+static Object* NumberAdd(Context* ctx, Object* a, Object* b) {
+  return NumberNew(ctx, addDoubles(numberValue(a), numberValue(b)));
+}
+
+static Object* NumberSub(Context* ctx, Object* a, Object* b) {
+  return NumberNew(ctx, subDoubles(numberValue(a), numberValue(b)));
+}
+
+static Object* NumberMul(Context* ctx, Object* a, Object* b) {
+  return NumberNew(ctx, mulDoubles(numberValue(a), numberValue(b)));
+}
+
+static Object* NumberDiv(Context* ctx, Object* a, Object* b) {
+  return NumberNew(ctx, divDoubles(numberValue(a), numberValue(b)));
+}
+
+static Object* IsNumber(Context* ctx, Object* o) {
+  return o && NumberP(o) ? o : NULL;
+}
+
+static Function fNumberAdd;
+static Function fNumberSub;
+static Function fNumberMul;
+static Function fNumberDiv;
+static Function fIsNumber;
+
 static int ListP(Object* o) {
-  return o->type == &tList;
+  return ObjectGetType(o) == &tList;
 }
 
-static Object* ListPrint(Context* ctx) {
-  Object* o = StackPop(ctx->stack);
+static Object* ListPrint(Context* ctx, Object* o) {
   if(!ListP(o)) {
     abort(); // TODO: return error
   }
   List* l = ObjectGetDataPtr(o);
   fputc('(', stdout);
   while(l->value) {
-    if(l->value->type->printFn && l->value->type->printFn->isBuiltIn) {
-      StackPush(ctx->stack, l->value);
-      l->value->type->printFn->builtIn(ctx);
-      if(l->next && ListP(l->next) && ((List*)ObjectGetDataPtr(l->next))->value) {
+    Type* type = ObjectGetType(RefGet(l->value));
+    if(type->printFn && type->printFn->isBuiltIn) {
+      type->printFn->fn1(ctx, RefGet(l->value));
+      if(l->next && ListP(RefGet(l->next)) && RefGet(((List*)ObjectGetDataPtr(RefGet(l->next)))->value)) {
         fputc(' ', stdout);
       }
     }
     if(!l->next) {
       break;
     }
-    o = l->next;
+    o = RefGet(l->next);
     if(!ListP(o)) {
       abort(); // TODO: return error
     }
@@ -521,14 +1381,41 @@ static Object* ListPrint(Context* ctx) {
   return NULL;
 }
 
+// Takes any number of arguments and returns a list of them. Lists end at the
+// first cell without a value, so nil can not be an element.
+static Object* ListMake(Context* ctx, unsigned int nArgs) {
+  for(unsigned int i = 0; i < nArgs; ++i) {
+    if(!ctx->stack->data[ctx->stack->top - 1 - i]) {
+      abort(); // TODO: error; nil in list
+    }
+  }
+  Object* next = NULL;
+  for(unsigned int i = 0; i < nArgs || !next; ++i) {
+    Object* o = ObjectAllocRaw(ctx, &tList);
+    if(!o) {
+      abort(); // TODO: return error
+    }
+    List* l = ObjectGetDataPtr(o);
+    l->value = RefMake(i < nArgs ? StackPop(ctx->stack) : NULL);
+    l->next = RefMake(next);
+    next = o;
+  }
+  return next;
+}
+
+static Object* IsList(Context* ctx, Object* o) {
+  return o && ListP(o) ? o : NULL;
+}
+
 static Function fListPrint;
+static Function fListMake;
+static Function fIsList;
 
 static int FunctionP(Object* o) {
-  return o->type == &tFunction;
+  return ObjectGetType(o) == &tFunction;
 }
 
-static Object* FunctionPrint(Context* ctx) {
-  Object* o = StackPop(ctx->stack);
+static Object* FunctionPrint(Context* ctx, Object* o) {
   if(!FunctionP(o)) {
     abort(); // TODO: return error
   }
@@ -537,32 +1424,1233 @@ static Object* FunctionPrint(Context* ctx) {
   return NULL;
 }
 
-static Function fFunctionPrint;
+static Object* RecordCall(Context* ctx, Function* f, unsigned int nArgs);
+static Object* RecordCallForm(Context* ctx, Function* f, Object* rest);
 
-static void initBuiltins() {
-  // TODO: make thread safe
-  static int initDone = 0;
-  if(initDone) {
-    return;
+// Calls a builtin with nArgs arguments taken from the stack, pushed in order.
+// This is the generic path for when the arity is not known up front, direct
+// calls to a fixed arity builtin should go through its fnN entry instead.
+static Object* FunctionApply(Context* ctx, Function* f, unsigned int nArgs) {
+  if(f->recordType) {
+    return RecordCall(ctx, f, nArgs);
   }
-  initDone = 1;
+  if(!f->isBuiltIn) {
+    abort(); // TODO: error; only builtins can be called
+  }
+  if(f->arity == ARITY_VARIADIC) {
+    return f->builtIn(ctx, nArgs);
+  }
+  if(nArgs != (unsigned int)f->arity) {
+    abort(); // TODO: error; wrong number of arguments
+  }
+  Object* args[4];
+  for(unsigned int i = nArgs; i > 0; --i) {
+    args[i - 1] = StackPop(ctx->stack);
+  }
+  switch(f->arity) {
+  case 0: return f->fn0(ctx);
+  case 1: return f->fn1(ctx, args[0]);
+  case 2: return f->fn2(ctx, args[0], args[1]);
+  case 3: return f->fn3(ctx, args[0], args[1], args[2]);
+  case 4: return f->fn4(ctx, args[0], args[1], args[2], args[3]);
+  }
+  abort();
+}
 
-  // Number
+static Object* IsFunction(Context* ctx, Object* o) {
+  return o && FunctionP(o) ? o : NULL;
+}
 
-  tNumber.alignment = sizeof(double);
-  tNumber.nFields = 0;
-  tNumber.size = sizeof(Number);
-  tNumber.fields = NULL;
-  tNumber.name = "Number";
+static Function fFunctionPrint;
+static Function fIsFunction;
+
+static Object* IsSymbol(Context* ctx, Object* o) {
+  return o && SymbolP(o) ? o : NULL;
+}
+
+static Function fIsSymbol;
+
+static Object* ObjectEval(Context* ctx, Object* o) {
+  if(!o) {
+    return NULL;
+  }
+  Type* type = ObjectGetType(o);
+  if(type->evalFn && type->evalFn->isBuiltIn) {
+    return type->evalFn->fn1(ctx, o);
+  }
+  return o;
+}
+
+static int evalNumberSite(Context* ctx, Object* form, double* value, Object** boxed);
+
+// Aborts when a task is about to run out of C stack, see TASK_STACK_RESERVE.
+static void checkTaskStack(Context* ctx) {
+  char here;
+  if(ctx->currentTask != &ctx->mainTask &&
+     &here - (char*)ctx->currentTask->context.uc_stack.ss_sp < TASK_STACK_RESERVE) {
+    abort(); // TODO: error; nested too deeply for a task
+  }
+}
+
+// Evaluates an argument of a call with a numeric fast path. Returns 1 and
+// stores the value if the result is a number, otherwise returns 0. boxed is
+// set to the result object if there is one; a number is never boxed when the
+// argument is itself a call with a numeric fast path on numbers.
+static int evalNumberArg(Context* ctx, Object* form, double* value, Object** boxed) {
+  Object* o;
+  if(form && ListP(form) && ObjectGetFlags(form) != SITE_GENERIC &&
+     ((List*)ObjectGetDataPtr(form))->value) {
+    *boxed = NULL;
+    if(evalNumberSite(ctx, form, value, boxed)) {
+      return 1;
+    }
+    o = *boxed;
+  }
+  else {
+    o = form && NumberP(form) ? form : ObjectEval(ctx, form);
+  }
+  *boxed = o;
+  if(o && NumberP(o)) {
+    *value = ((Number*)ObjectGetDataPtr(o))->value;
+    return 1;
+  }
+  return 0;
+}
+
+// Records the argument types seen by a call to a builtin with a numeric fast path.
+static void recordSiteFeedback(Object* form, int sawNumbers) {
+  unsigned int state = ObjectGetFlags(form);
+  if(state == SITE_GENERIC || state == SITE_NUMBER) {
+    return;
+  }
+  if(sawNumbers) {
+    ObjectSetFlags(form, state + 1 == SITE_HOT_COUNT ? SITE_NUMBER : state + 1);
+  }
+  else {
+    ObjectSetFlags(form, SITE_GENERIC);
+  }
+}
+
+// Evaluates a call to a builtin with a numeric fast path. If both arguments
+// are numbers returns 1 and the unboxed result. Otherwise the site becomes
+// SITE_GENERIC and 0 is returned with the result computed the generic way,
+// boxing only the arguments that were not objects already.
+static int evalNumberCall(Context* ctx, Object* form, Function* f, double* value, Object** boxed) {
+  checkTaskStack(ctx);
+  List* l = ObjectGetDataPtr(form);
+  List* first = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+  List* second = first && first->next ? ObjectGetDataPtr(RefGet(first->next)) : NULL;
+  if(!second || !second->value ||
+     (second->next && RefGet(((List*)ObjectGetDataPtr(RefGet(second->next)))->value))) {
+    abort(); // TODO: error; wrong number of arguments
+  }
+
+  double a, b;
+  Object* boxedA;
+  Object* boxedB;
+  int isNumberA = evalNumberArg(ctx, RefGet(first->value), &a, &boxedA);
+  int isNumberB = evalNumberArg(ctx, RefGet(second->value), &b, &boxedB);
+  recordSiteFeedback(form, isNumberA && isNumberB);
+  if(isNumberA && isNumberB) {
+    *value = f->numberFn(a, b);
+    return 1;
+  }
+
+  if(!boxedA) {
+    boxedA = NumberNew(ctx, a);
+  }
+  if(!boxedB) {
+    boxedB = NumberNew(ctx, b);
+  }
+  *boxed = f->fn2(ctx, boxedA, boxedB);
+  return 0;
+}
+
+static Object* listApply(Context* ctx, Object* o, Object* head);
+
+// Evaluates a call that is not SITE_GENERIC. While the callee has a numeric
+// fast path and both arguments are numbers, returns 1 and the unboxed result,
+// so that nested arithmetic allocates no intermediate numbers. Otherwise
+// returns 0 with the result computed the generic way. A call specialised to
+// SITE_NUMBER whose callee has no fast path is deoptimised to SITE_GENERIC.
+static int evalNumberSite(Context* ctx, Object* form, double* value, Object** boxed) {
+  List* l = ObjectGetDataPtr(form);
+  Object* head = ObjectEval(ctx, RefGet(l->value));
+  Function* f = head && FunctionP(head) ? ObjectGetDataPtr(head) : NULL;
+  if(!f || !f->numberFn) {
+    if(ObjectGetFlags(form) == SITE_NUMBER) {
+      ObjectSetFlags(form, SITE_GENERIC);
+    }
+    *boxed = listApply(ctx, form, head);
+    return 0;
+  }
+  return evalNumberCall(ctx, form, f, value, boxed);
+}
+
+// Evaluates a call. The head is evaluated and if it is a function it is
+// called with the rest of the evaluated elements as arguments, see listApply.
+static Object* ListEval(Context* ctx, Object* o) {
+  if(!ListP(o)) {
+    abort(); // TODO: error
+  }
+  if(ObjectGetFlags(o) == SITE_NUMBER) {
+    double value;
+    Object* boxed;
+    if(evalNumberSite(ctx, o, &value, &boxed)) {
+      return NumberNew(ctx, value);
+    }
+    return boxed;
+  }
+
+  List* l = ObjectGetDataPtr(o);
+  if(!l->value) {
+    return o;
+  }
+  checkTaskStack(ctx);
+  return listApply(ctx, o, ObjectEval(ctx, RefGet(l->value)));
+}
+
+// Calls the evaluated head of the call o. Calls to fixed arity builtins pass
+// the arguments directly, and calls to builtins with a numeric fast path pass
+// numbers unboxed where they can. Anything else goes through FunctionApply.
+static Object* listApply(Context* ctx, Object* o, Object* head) {
+  if(!head || !FunctionP(head)) {
+    // TODO: error? Until there is quoting, lists that are not calls are data
+    // and evaluate to themselves.
+    return o;
+  }
+  Function* f = ObjectGetDataPtr(head);
+  if(f->isSpecial) {
+    return f->fn1(ctx, o);
+  }
+
+  List* l = ObjectGetDataPtr(o);
+  Object* args[4];
+  unsigned int nArgs = 0;
+  Object* rest = RefGet(l->next);
+  if(f->recordType) {
+    return RecordCallForm(ctx, f, rest);
+  }
+  if(f->numberFn && ObjectGetFlags(o) != SITE_GENERIC) {
+    double value;
+    Object* boxed;
+    if(evalNumberCall(ctx, o, f, &value, &boxed)) {
+      return NumberNew(ctx, value);
+    }
+    return boxed;
+  }
+  if(f->isBuiltIn && f->arity != ARITY_VARIADIC) {
+    while(rest && ((List*)ObjectGetDataPtr(rest))->value) {
+      if(nArgs == (unsigned int)f->arity) {
+        abort(); // TODO: error; wrong number of arguments
+      }
+      List* arg = ObjectGetDataPtr(rest);
+      args[nArgs++] = ObjectEval(ctx, RefGet(arg->value));
+      rest = RefGet(arg->next);
+    }
+    if(nArgs != (unsigned int)f->arity) {
+      abort(); // TODO: error; wrong number of arguments
+    }
+    switch(f->arity) {
+    case 0: return f->fn0(ctx);
+    case 1: return f->fn1(ctx, args[0]);
+    case 2: return f->fn2(ctx, args[0], args[1]);
+    case 3: return f->fn3(ctx, args[0], args[1], args[2]);
+    case 4: return f->fn4(ctx, args[0], args[1], args[2], args[3]);
+    }
+    abort();
+  }
+
+  while(rest && ((List*)ObjectGetDataPtr(rest))->value) {
+    List* arg = ObjectGetDataPtr(rest);
+    StackPush(ctx->stack, ObjectEval(ctx, RefGet(arg->value)));
+    ++nArgs;
+    rest = RefGet(arg->next);
+  }
+  return FunctionApply(ctx, f, nArgs);
+}
+
+static Function fListEval;
+
+// Constant folding
+
+// Returns the function a list calls if it is known without evaluating
+// anything, that is if its head is a symbol bound to a function.
+static Object* foldCallee(Context* ctx, Object* o) {
+  if(!o || !ListP(o)) {
+    return NULL;
+  }
+  List* l = ObjectGetDataPtr(o);
+  if(!l->value || !SymbolP(RefGet(l->value))) {
+    return NULL;
+  }
+  Object* head = EnvironmentGet(ctx, ObjectGetDataPtr(RefGet(l->value)));
+  return head && FunctionP(head) ? head : NULL;
+}
+
+// Returns whether the form calls a special form anywhere. Those can rebind
+// names or take their arguments as data, so such forms are not folded.
+static int foldHasSpecial(Context* ctx, Object* o) {
+  if(!o || !ListP(o)) {
+    return 0;
+  }
+  Object* head = foldCallee(ctx, o);
+  if(head && ((Function*)ObjectGetDataPtr(head))->isSpecial) {
+    return 1;
+  }
+  for(List* l = ObjectGetDataPtr(o); l && RefGet(l->value); l = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL) {
+    if(foldHasSpecial(ctx, RefGet(l->value))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns whether the form is a number or a call to a pure builtin on
+// constant arguments, which can be evaluated once and for all.
+static int foldIsConstant(Context* ctx, Object* o) {
+  if(!o || NumberP(o)) {
+    return o != NULL;
+  }
+  Object* head = foldCallee(ctx, o);
+  if(!head || !((Function*)ObjectGetDataPtr(head))->isPure) {
+    return 0;
+  }
+  List* call = ObjectGetDataPtr(o);
+  for(List* l = call->next ? ObjectGetDataPtr(RefGet(call->next)) : NULL; l && l->value;
+      l = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL) {
+    if(!foldIsConstant(ctx, RefGet(l->value))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Returns the form with every call to a pure builtin on constant arguments
+// replaced by its result. A constant call is evaluated as a whole, so that
+// the calls nested in it pass their results unboxed. Forms are never changed
+// in place, as the reader may share them; a call with a folded argument is
+// copied, with the builtin itself as its head so that evaluating it needs no
+// lookup. Other calls are kept as they are, so that the call site feedback
+// recorded in them survives from one evaluation to the next.
+static Object* foldForm(Context* ctx, Object* o) {
+  Object* head = foldCallee(ctx, o);
+  if(!head) {
+    // Not a call, so nothing in it is evaluated.
+    return o;
+  }
+  if(foldIsConstant(ctx, o)) {
+    Object* value = ListEval(ctx, o);
+    return value && NumberP(value) ? value : o;
+  }
+  Function* f = ObjectGetDataPtr(head);
+  List* l = ObjectGetDataPtr(o);
+  char changed = 0;
+  unsigned int base = ctx->stack->top;
+  StackPush(ctx->stack, f->isBuiltIn ? head : RefGet(l->value));
+  for(Object* rest = RefGet(l->next); rest && RefGet(((List*)ObjectGetDataPtr(rest))->value);
+      rest = RefGet(((List*)ObjectGetDataPtr(rest))->next)) {
+    Object* arg = RefGet(((List*)ObjectGetDataPtr(rest))->value);
+    Object* folded = foldForm(ctx, arg);
+    if(folded != arg) {
+      changed = 1;
+    }
+    StackPush(ctx->stack, folded);
+  }
+  if(!changed) {
+    ctx->stack->top = base;
+    return o;
+  }
+  return ListMake(ctx, ctx->stack->top - base);
+}
+
+// Folds a top level form before it is evaluated, see foldForm.
+static Object* FoldForm(Context* ctx, Object* o) {
+  if(foldHasSpecial(ctx, o)) {
+    return o;
+  }
+  return foldForm(ctx, o);
+}
+
+// Records
+
+static Type* TypeFind(const char* name) {
+  for(unsigned int i = 1; i < typeTableSize; ++i) {
+    if(types[i] && strcmp(types[i]->name, name) == 0) {
+      return types[i];
+    }
+  }
+  return NULL;
+}
+
+static char* contextStrdup(Context* ctx, const char* str) {
+  unsigned int len = strlen(str);
+  char* copy = ContextAlloc(ctx, len + 1);
+  if(!copy) {
+    abort(); // TODO: return error
+  }
+  memcpy(copy, str, len + 1);
+  return copy;
+}
+
+// Size of a field in a record or a table column. Fields without a type hold
+// an object reference, typed fields hold the data of their type inline.
+static unsigned int fieldSize(Type* fieldType) {
+  return fieldType ? fieldType->size : sizeof(Ref);
+}
+
+static unsigned int fieldAlignment(Type* fieldType) {
+  return fieldType ? fieldType->alignment : sizeof(Ref);
+}
+
+static int RecordP(Object* o) {
+  return ObjectGetType(o)->offsets != NULL;
+}
+
+// Returns the value of a field, boxing inline data into a new object.
+static Object* RecordGet(Context* ctx, Object* o, unsigned int field) {
+  Type* type = ObjectGetType(o);
+  char* fieldPtr = (char*)ObjectGetDataPtr(o) + type->offsets[field];
+  Type* fieldType = type->fields[field];
+  if(!fieldType) {
+    return RefGet(*(Ref*)fieldPtr);
+  }
+  Object* value = ObjectAllocRaw(ctx, fieldType);
+  if(!value) {
+    abort(); // TODO: return error
+  }
+  memcpy(ObjectGetDataPtr(value), fieldPtr, fieldType->size);
+  return value;
+}
+
+static void RecordSet(Object* o, unsigned int field, Object* value) {
+  Type* type = ObjectGetType(o);
+  char* fieldPtr = (char*)ObjectGetDataPtr(o) + type->offsets[field];
+  Type* fieldType = type->fields[field];
+  if(!fieldType) {
+    *(Ref*)fieldPtr = RefMake(value);
+    return;
+  }
+  if(!value || ObjectGetType(value) != fieldType) {
+    abort(); // TODO: error; wrong field type
+  }
+  memcpy(fieldPtr, ObjectGetDataPtr(value), fieldType->size);
+}
+
+static Object* recordAccess(Context* ctx, Function* accessor, Object* o) {
+  if(!o || ObjectGetType(o) != accessor->recordType) {
+    abort(); // TODO: error; wrong type
+  }
+  return RecordGet(ctx, o, accessor->field);
+}
+
+// Calls a record constructor or field accessor with nArgs arguments from the stack.
+static Object* RecordCall(Context* ctx, Function* f, unsigned int nArgs) {
+  Type* type = f->recordType;
+  if(f->field >= 0) {
+    if(nArgs != 1) {
+      abort(); // TODO: error; wrong number of arguments
+    }
+    return recordAccess(ctx, f, StackPop(ctx->stack));
+  }
+
+  if(nArgs != type->nFields) {
+    abort(); // TODO: error; wrong number of arguments
+  }
+  Object* o = ObjectAllocRaw(ctx, type);
+  if(!o) {
+    abort(); // TODO: return error
+  }
+  for(unsigned int i = nArgs; i > 0; --i) {
+    RecordSet(o, i - 1, StackPop(ctx->stack));
+  }
+  return o;
+}
+
+// Calls a record constructor or field accessor from a call form whose
+// arguments start at rest. The arguments are evaluated straight into the
+// record or the accessor, without going through the stack.
+static Object* RecordCallForm(Context* ctx, Function* f, Object* rest) {
+  List* arg = rest ? ObjectGetDataPtr(rest) : NULL;
+  if(f->field >= 0) {
+    if(!arg || !arg->value || (arg->next && RefGet(((List*)ObjectGetDataPtr(RefGet(arg->next)))->value))) {
+      abort(); // TODO: error; wrong number of arguments
+    }
+    return recordAccess(ctx, f, ObjectEval(ctx, RefGet(arg->value)));
+  }
+
+  Type* type = f->recordType;
+  Object* o = ObjectAllocRaw(ctx, type);
+  if(!o) {
+    abort(); // TODO: return error
+  }
+  for(unsigned int i = 0; i < type->nFields; ++i) {
+    if(!arg || !arg->value) {
+      abort(); // TODO: error; wrong number of arguments
+    }
+    RecordSet(o, i, ObjectEval(ctx, RefGet(arg->value)));
+    arg = arg->next ? ObjectGetDataPtr(RefGet(arg->next)) : NULL;
+  }
+  if(arg && arg->value) {
+    abort(); // TODO: error; wrong number of arguments
+  }
+  return o;
+}
+
+static Object* RecordPrint(Context* ctx, Object* o) {
+  if(!RecordP(o)) {
+    abort(); // TODO: return error
+  }
+  Type* type = ObjectGetType(o);
+  printf("#<%s [", type->name);
+  for(unsigned int i = 0; i < type->nFields; ++i) {
+    Object* value = RecordGet(ctx, o, i);
+    if(i > 0) {
+      fputc(' ', stdout);
+    }
+    if(!value) {
+      fputs("nil", stdout);
+    }
+    else if(ObjectGetType(value)->printFn) {
+      ObjectGetType(value)->printFn->fn1(ctx, value);
+    }
+  }
+  fputs("]>", stdout);
+  return NULL;
+}
+
+static Function fRecordPrint;
+
+static Object* functionNew(Context* ctx, const char* name, Type* recordType, int field) {
+  Object* o = ObjectAllocRaw(ctx, &tFunction);
+  if(!o) {
+    abort(); // TODO: return error
+  }
+  Function* f = ObjectGetDataPtr(o);
+  memset(f, 0, sizeof(Function));
+  f->name = contextStrdup(ctx, name);
+  f->arity = field >= 0 ? 1 : (int)recordType->nFields;
+  f->recordType = recordType;
+  f->field = field;
+  return o;
+}
+
+// Creates a record type with the given fields. A field is either a symbol,
+// holding any object, or a list of a symbol and a type name, holding the data
+// of that type inline. Fields are laid out in order at fixed, aligned offsets.
+// The type is owned by the context and unregistered when it is reset or deleted.
+static Type* RecordTypeNew(Context* ctx, const char* name, unsigned int nFields, Object** fieldSpecs) {
+  Type* type = ContextAlloc(ctx, sizeof(Type));
+  if(!type) {
+    abort(); // TODO: return error
+  }
+  memset(type, 0, sizeof(Type));
+  type->name = contextStrdup(ctx, name);
+  type->nFields = nFields;
+  type->fields = ContextAlloc(ctx, sizeof(Type*) * nFields + 1);
+  type->fieldNames = ContextAlloc(ctx, sizeof(char*) * nFields + 1);
+  type->offsets = ContextAlloc(ctx, sizeof(unsigned int) * nFields + 1);
+  if(!type->fields || !type->fieldNames || !type->offsets) {
+    abort(); // TODO: return error
+  }
+
+  unsigned int offset = 0;
+  type->alignment = 1;
+  for(unsigned int i = 0; i < nFields; ++i) {
+    Object* spec = fieldSpecs[i];
+    Type* fieldType = NULL;
+    if(spec && ListP(spec)) {
+      List* l = ObjectGetDataPtr(spec);
+      List* typeCell = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+      if(!typeCell || !typeCell->value || !SymbolP(RefGet(typeCell->value))) {
+        abort(); // TODO: error; bad field
+      }
+      fieldType = TypeFind(((Symbol*)ObjectGetDataPtr(RefGet(typeCell->value)))->name);
+      if(!fieldType || fieldType->deleteFn) {
+        abort(); // TODO: error; type can not be stored inline
+      }
+      spec = RefGet(l->value);
+    }
+    if(!spec || !SymbolP(spec)) {
+      abort(); // TODO: error; bad field
+    }
+    unsigned int alignment = fieldAlignment(fieldType);
+    offset = alignOffset(offset, alignment);
+    type->fields[i] = fieldType;
+    type->fieldNames[i] = contextStrdup(ctx, ((Symbol*)ObjectGetDataPtr(spec))->name);
+    type->offsets[i] = offset;
+    offset += fieldSize(fieldType);
+    if(alignment > type->alignment) {
+      type->alignment = alignment;
+    }
+  }
+  type->size = alignOffset(offset, type->alignment);
+  type->printFn = &fRecordPrint;
+
+  TypeRegister(type);
+  type->next = ctx->recordTypes;
+  ctx->recordTypes = type;
+  return type;
+}
+
+// (defrecord Name field...) defines a record type. Binds the constructor
+// under Name and an accessor for each field under Name-field, and returns
+// the constructor.
+static Object* DefRecord(Context* ctx, Object* form) {
+  List* l = ObjectGetDataPtr(form);
+  List* nameCell = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+  if(!nameCell || !nameCell->value || !SymbolP(RefGet(nameCell->value))) {
+    abort(); // TODO: error; record needs a name
+  }
+  const char* name = ((Symbol*)ObjectGetDataPtr(RefGet(nameCell->value)))->name;
+
+  unsigned int base = ctx->stack->top;
+  for(Object* rest = RefGet(nameCell->next); rest && RefGet(((List*)ObjectGetDataPtr(rest))->value);
+      rest = RefGet(((List*)ObjectGetDataPtr(rest))->next)) {
+    StackPush(ctx->stack, RefGet(((List*)ObjectGetDataPtr(rest))->value));
+  }
+  unsigned int nFields = ctx->stack->top - base;
+  Type* type = RecordTypeNew(ctx, name, nFields, &ctx->stack->data[base]);
+  ctx->stack->top = base;
+
+  Object* constructor = functionNew(ctx, name, type, -1);
+  EnvironmentBind(ctx->environment, name, constructor);
+  unsigned int nameLen = strlen(name);
+  for(unsigned int i = 0; i < nFields; ++i) {
+    unsigned int fieldLen = strlen(type->fieldNames[i]);
+    char* accessorName = malloc(nameLen + fieldLen + 2);
+    if(!accessorName) {
+      abort(); // TODO: return error
+    }
+    memcpy(accessorName, name, nameLen);
+    accessorName[nameLen] = '-';
+    memcpy(accessorName + nameLen + 1, type->fieldNames[i], fieldLen + 1);
+    EnvironmentBind(ctx->environment, accessorName, functionNew(ctx, accessorName, type, i));
+    free(accessorName);
+  }
+  return constructor;
+}
+
+static Function fDefRecord;
+
+// Tables store records column by column: each field has its own array, so
+// scanning one field touches only that field's memory, sequentially.
+
+static int TableP(Object* o) {
+  return ObjectGetType(o) == &tTable;
+}
+
+static Table* tableData(Object* o) {
+  if(!o || !TableP(o)) {
+    abort(); // TODO: error; wrong type
+  }
+  return ObjectGetDataPtr(o);
+}
+
+static Function* recordFunction(Object* o) {
+  if(!o || !FunctionP(o) || !((Function*)ObjectGetDataPtr(o))->recordType) {
+    abort(); // TODO: error; not a record constructor or accessor
+  }
+  return ObjectGetDataPtr(o);
+}
+
+// (table Name) returns an empty table of Name records, given the constructor.
+static Object* TableNew(Context* ctx, Object* constructor) {
+  Type* type = recordFunction(constructor)->recordType;
+  Object* o = ObjectAllocRaw(ctx, &tTable);
+  if(!o) {
+    abort(); // TODO: return error
+  }
+  Table* t = ObjectGetDataPtr(o);
+  t->recordType = type;
+  t->nRows = 0;
+  t->capacity = 0;
+  t->columns = calloc(type->nFields + 1, sizeof(char*));
+  if(!t->columns) {
+    abort(); // TODO: return error
+  }
+  return o;
+}
+
+static Object* TableDelete(Context* ctx, Object* o) {
+  Table* t = tableData(o);
+  for(unsigned int i = 0; i < t->recordType->nFields; ++i) {
+    free(t->columns[i]);
+  }
+  free(t->columns);
+  return NULL;
+}
+
+// (table-add t record) appends a record to the table and returns the table.
+static Object* TableAdd(Context* ctx, Object* table, Object* record) {
+  Table* t = tableData(table);
+  Type* type = t->recordType;
+  if(!record || ObjectGetType(record) != type) {
+    abort(); // TODO: error; wrong type
+  }
+  if(t->nRows == t->capacity) {
+    unsigned int newCapacity = t->capacity ? t->capacity * 2 : 64;
+    for(unsigned int i = 0; i < type->nFields; ++i) {
+      char* newColumn = realloc(t->columns[i], (unsigned long long)newCapacity * fieldSize(type->fields[i]));
+      if(!newColumn) {
+        abort(); // TODO: return error
+      }
+      t->columns[i] = newColumn;
+    }
+    t->capacity = newCapacity;
+  }
+  char* data = ObjectGetDataPtr(record);
+  for(unsigned int i = 0; i < type->nFields; ++i) {
+    unsigned int size = fieldSize(type->fields[i]);
+    memcpy(t->columns[i] + (unsigned long long)t->nRows * size, data + type->offsets[i], size);
+  }
+  ++t->nRows;
+  return table;
+}
+
+static Object* TableCount(Context* ctx, Object* table) {
+  return NumberNew(ctx, tableData(table)->nRows);
+}
+
+// (table-get t i) returns a new record with the fields of row i.
+static Object* TableGet(Context* ctx, Object* table, Object* index) {
+  Table* t = tableData(table);
+  double row = numberValue(index);
+  if(row < 0 || row >= t->nRows) {
+    abort(); // TODO: error; index out of range
+  }
+  Type* type = t->recordType;
+  Object* o = ObjectAllocRaw(ctx, type);
+  if(!o) {
+    abort(); // TODO: return error
+  }
+  char* data = ObjectGetDataPtr(o);
+  for(unsigned int i = 0; i < type->nFields; ++i) {
+    unsigned int size = fieldSize(type->fields[i]);
+    memcpy(data + type->offsets[i], t->columns[i] + (unsigned long long)row * size, size);
+  }
+  return o;
+}
+
+// (table-sum t Name-field) sums one numeric field over all rows.
+static Object* TableSum(Context* ctx, Object* table, Object* accessor) {
+  Table* t = tableData(table);
+  Function* f = recordFunction(accessor);
+  if(f->recordType != t->recordType || f->field < 0) {
+    abort(); // TODO: error; not an accessor for this table
+  }
+  Type* fieldType = t->recordType->fields[f->field];
+  double sum = 0;
+  if(fieldType == &tNumber) {
+    const double* column = (const double*)t->columns[f->field];
+    for(unsigned int i = 0; i < t->nRows; ++i) {
+      sum += column[i];
+    }
+  }
+  else if(!fieldType) {
+    const Ref* column = (const Ref*)t->columns[f->field];
+    for(unsigned int i = 0; i < t->nRows; ++i) {
+      sum += numberValue(RefGet(column[i]));
+    }
+  }
+  else {
+    abort(); // TODO: error; not a numeric field
+  }
+  return NumberNew(ctx, sum);
+}
+
+static Object* TablePrint(Context* ctx, Object* o) {
+  Table* t = tableData(o);
+  printf("#<Table [%s %u]>", t->recordType->name, t->nRows);
+  return NULL;
+}
+
+static Function fTableNew;
+static Function fTableDelete;
+static Function fTableAdd;
+static Function fTableCount;
+static Function fTableGet;
+static Function fTableSum;
+static Function fTablePrint;
+
+// Tasks
+
+// Returns a C stack of TASK_STACK_SIZE bytes for a task, reusing the stack of
+// a finished task when there is one. Stacks are mapped with an inaccessible
+// guard page below them, so that a task that overflows its stack faults
+// instead of overwriting the memory next to it.
+static char* taskStackNew(Context* ctx) {
+  char* stack = ctx->freeTaskStacks;
+  if(stack) {
+    ctx->freeTaskStacks = *(char**)stack;
+    return stack;
+  }
+  long pageSize = sysconf(_SC_PAGESIZE);
+  char* mapping = mmap(NULL, TASK_STACK_SIZE + pageSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if(mapping == MAP_FAILED) {
+    return NULL;
+  }
+  if(mprotect(mapping, pageSize, PROT_NONE) != 0) {
+    munmap(mapping, TASK_STACK_SIZE + pageSize);
+    return NULL;
+  }
+  return mapping + pageSize;
+}
+
+// Keeps the stack of a finished task for the next task. The link to the
+// next free stack is stored at its lowest address, which a task only reaches
+// when it nests as deeply as it can.
+static void taskStackFree(Context* ctx, char* stack) {
+  *(char**)stack = ctx->freeTaskStacks;
+  ctx->freeTaskStacks = stack;
+}
+
+static void taskStacksDelete(Context* ctx) {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  while(ctx->freeTaskStacks) {
+    char* stack = ctx->freeTaskStacks;
+    ctx->freeTaskStacks = *(char**)stack;
+    munmap(stack - pageSize, TASK_STACK_SIZE + pageSize);
+  }
+}
+
+// Switches from the current task to another one. Returns when some task
+// switches back.
+static void taskSwitch(Context* ctx, Task* to) {
+  Task* from = ctx->currentTask;
+  ctx->currentTask = to;
+  ioLoop.ctx = ctx;
+  ctx->stack = to->stack;
+  if(swapcontext(&from->context, &to->context) != 0) {
+    abort(); // TODO: return error
+  }
+}
+
+// Lets the next task in the run queue run.
+static void ContextYield(Context* ctx) {
+  Task* current = ctx->currentTask;
+  if(current->next != current) {
+    taskSwitch(ctx, current->next);
+  }
+}
+
+// (yield) lets the next task in the run queue run. Returns the number of
+// tasks spawned that have not finished.
+static Object* Yield(Context* ctx) {
+  ContextYield(ctx);
+  return NumberNew(ctx, ctx->nTasks);
+}
+
+static void taskMain(unsigned int high, unsigned int low) {
+  Task* task = (Task*)(uintptr_t)(((unsigned long long)high << 32) | low);
+  Context* ctx = task->ctx;
+  ObjectEval(ctx, task->form);
+
+  task->prev->next = task->next;
+  task->next->prev = task->prev;
+  --ctx->nTasks;
+  if(!task->stack->dataInHeap) {
+    free(task->stack->data);
+  }
+  // The task's memory stays in the heap until it is rewound, and its C stack
+  // is only reused by a task spawned after switching away from this one, so
+  // it is fine to be running on them still.
+  taskStackFree(ctx, task->context.uc_stack.ss_sp);
+  Task* next = task->next;
+  ctx->currentTask = next;
+  ctx->stack = next->stack;
+  setcontext(&next->context);
+  abort();
+}
+
+// Makes task start in taskMain on cStack the first time it is switched to.
+// Kept apart from Spawn so that no caller of getcontext has locals live
+// across it.
+static void taskContextInit(Task* task, char* cStack) {
+  if(getcontext(&task->context) != 0) {
+    abort(); // TODO: return error
+  }
+  task->context.uc_stack.ss_sp = cStack;
+  task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+  task->context.uc_link = NULL;
+  unsigned long long address = (uintptr_t)task;
+  makecontext(&task->context, (void (*)(void))taskMain, 2,
+              (unsigned int)(address >> 32), (unsigned int)address);
+}
+
+// (spawn form) evaluates form in a new task and returns the number of tasks
+// spawned that have not finished, including the new one. The task and its
+// value stack are allocated in the context heap and its C stack comes from
+// taskStackNew; there is no thread behind it. Tasks switch only when one of
+// them yields, and a new task is queued to run after all others. The top
+// level form that spawned it does not finish until every task has.
+static Object* Spawn(Context* ctx, Object* form) {
+  List* l = ObjectGetDataPtr(form);
+  List* formCell = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+  if(!formCell || !formCell->value) {
+    abort(); // TODO: error; nothing to spawn
+  }
+  Task* task = ContextAlloc(ctx, sizeof(Task));
+  Stack* values = ContextAlloc(ctx, sizeof(Stack));
+  Object** valueData = ContextAlloc(ctx, sizeof(Object*) * TASK_VALUE_STACK_SIZE);
+  char* cStack = taskStackNew(ctx);
+  if(!task || !values || !valueData || !cStack) {
+    abort(); // TODO: return error
+  }
+  values->size = TASK_VALUE_STACK_SIZE;
+  values->top = 0;
+  values->data = valueData;
+  values->dataInHeap = 1;
+  task->stack = values;
+  task->ctx = ctx;
+  task->form = RefGet(formCell->value);
+  taskContextInit(task, cStack);
+
+  Task* current = ctx->currentTask;
+  task->next = current;
+  task->prev = current->prev;
+  current->prev->next = task;
+  current->prev = task;
+  ++ctx->nTasks;
+  ioLoop.ctx = ctx;
+  return NumberNew(ctx, ctx->nTasks);
+}
+
+// Runs the other tasks until all of them are done. Meanwhile the caller
+// counts as waiting, so that they may block for input.
+static void ContextRunTasks(Context* ctx) {
+  while(ctx->nTasks) {
+    ++ctx->nWaiting;
+    ContextYield(ctx);
+    --ctx->nWaiting;
+  }
+}
+
+static Function fYield;
+static Function fSpawn;
+
+// Sequences
+
+#define SEQ_READ 0
+#define SEQ_MAP 1
+#define SEQ_FILTER 2
+#define SEQ_TAKE 3
+
+static Reader* ReaderNew(StreamType inputType, const char* strOrFileName);
+static Object* ReaderRead(Context* ctx, Reader* r);
+
+static int SeqP(Object* o) {
+  return ObjectGetType(o) == &tSeq;
+}
+
+static Seq* seqData(Object* o) {
+  if(!o || !SeqP(o)) {
+    abort(); // TODO: error; wrong type
+  }
+  return ObjectGetDataPtr(o);
+}
+
+static Function* functionData(Object* o) {
+  if(!o || !FunctionP(o)) {
+    abort(); // TODO: error; not a function
+  }
+  return ObjectGetDataPtr(o);
+}
+
+// Calls a function with arguments from an array, directly if it is a builtin
+// of that arity.
+static Object* functionCall(Context* ctx, Function* f, unsigned int nArgs, Object** args) {
+  if(f->isBuiltIn && f->arity == (int)nArgs && !f->isSpecial) {
+    switch(nArgs) {
+    case 1: return f->fn1(ctx, args[0]);
+    case 2: return f->fn2(ctx, args[0], args[1]);
+    }
+  }
+  for(unsigned int i = 0; i < nArgs; ++i) {
+    StackPush(ctx->stack, args[i]);
+  }
+  return FunctionApply(ctx, f, nArgs);
+}
+
+// The reader at the start of a chain of sequences.
+static Reader* seqReader(Object* o) {
+  Seq* seq = seqData(o);
+  while(seq->kind != SEQ_READ) {
+    seq = seqData(seq->source);
+  }
+  return seq->reader;
+}
+
+// Realises the next element of a sequence into element. Returns 0 once the
+// sequence is exhausted. Sequences are single pass, an element is not kept
+// by the sequence after it has been returned.
+static int seqNext(Context* ctx, Object* o, Object** element) {
+  Seq* seq = seqData(o);
+  switch(seq->kind) {
+  case SEQ_READ:
+    *element = ReaderRead(ctx, seq->reader);
+    return *element != NULL;
+  case SEQ_MAP:
+    if(!seqNext(ctx, seq->source, element)) {
+      return 0;
+    }
+    *element = functionCall(ctx, seq->fn, 1, element);
+    return 1;
+  case SEQ_FILTER: {
+    Reader* r = seqReader(seq->source);
+    HeapMark mark;
+    HeapMarkSet(ctx, r, &mark);
+    while(seqNext(ctx, seq->source, element)) {
+      if(functionCall(ctx, seq->fn, 1, element)) {
+        return 1;
+      }
+      // Drop the rejected element, and whatever it took to produce it.
+      if(HeapRewindForm(ctx, r, &mark) == 0) {
+        HeapMarkSet(ctx, r, &mark);
+      }
+    }
+    return 0;
+  }
+  case SEQ_TAKE:
+    if(seq->remaining <= 0) {
+      return 0;
+    }
+    --seq->remaining;
+    return seqNext(ctx, seq->source, element);
+  }
+  abort();
+}
+
+static Object* seqNew(Context* ctx, char kind, Object* source) {
+  Object* o = ObjectAllocRaw(ctx, &tSeq);
+  if(!o) {
+    abort(); // TODO: return error
+  }
+  Seq* seq = ObjectGetDataPtr(o);
+  memset(seq, 0, sizeof(Seq));
+  seq->kind = kind;
+  if(source) {
+    seqData(source);
+    seq->source = source;
+  }
+  return o;
+}
+
+// (read-seq file) returns a sequence of the forms in file, read as they are
+// needed. The file name is not evaluated.
+static Object* SeqRead(Context* ctx, Object* form) {
+  List* l = ObjectGetDataPtr(form);
+  List* nameCell = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+  if(!nameCell || !nameCell->value || !SymbolP(RefGet(nameCell->value))) {
+    abort(); // TODO: error; needs a file name
+  }
+  Reader* r = ReaderNew(ST_FILE, ((Symbol*)ObjectGetDataPtr(RefGet(nameCell->value)))->name);
+  if(!r) {
+    abort(); // TODO: error; could not open file
+  }
+  Object* o = seqNew(ctx, SEQ_READ, NULL);
+  seqData(o)->reader = r;
+  return o;
+}
+
+static Object* SeqDelete(Context* ctx, Object* o) {
+  Seq* seq = seqData(o);
+  if(seq->kind == SEQ_READ) {
+    ReaderDelete(seq->reader);
+  }
+  return NULL;
+}
+
+// (seq-map f s) returns a sequence of f applied to the elements of s.
+static Object* SeqMap(Context* ctx, Object* f, Object* source) {
+  Object* o = seqNew(ctx, SEQ_MAP, source);
+  seqData(o)->fn = functionData(f);
+  return o;
+}
+
+// (seq-filter f s) returns a sequence of the elements of s for which f is not nil.
+static Object* SeqFilter(Context* ctx, Object* f, Object* source) {
+  Object* o = seqNew(ctx, SEQ_FILTER, source);
+  seqData(o)->fn = functionData(f);
+  return o;
+}
+
+// (seq-take n s) returns a sequence of the first n elements of s.
+static Object* SeqTake(Context* ctx, Object* n, Object* source) {
+  Object* o = seqNew(ctx, SEQ_TAKE, source);
+  seqData(o)->remaining = numberValue(n);
+  return o;
+}
+
+// The consumers below drop each element, and whatever was allocated to
+// produce it, before realising the next one, so that a sequence over a file
+// of any size runs in constant memory. They yield after every element.
+
+// (seq-count s) returns the number of elements in s.
+static Object* SeqCount(Context* ctx, Object* o) {
+  Reader* r = seqReader(o);
+  double count = 0;
+  HeapMark mark;
+  HeapMarkSet(ctx, r, &mark);
+  Object* element;
+  while(seqNext(ctx, o, &element)) {
+    ++count;
+    ContextYield(ctx);
+    if(HeapRewindForm(ctx, r, &mark) == 0) {
+      HeapMarkSet(ctx, r, &mark);
+    }
+  }
+  return NumberNew(ctx, count);
+}
+
+// (seq-reduce f init s) combines the elements of s with f, starting from
+// init. Memory stays bounded as long as the result of f is a number, any
+// other result is kept alive along with what it refers to.
+static Object* SeqReduce(Context* ctx, Object* f, Object* init, Object* o) {
+  Function* fn = functionData(f);
+  Reader* r = seqReader(o);
+  // A number result is copied into a box of our own before the rest of a
+  // step is dropped.
+  Object* box = NumberNew(ctx, 0);
+  Object* args[2] = { init, NULL };
+  HeapMark mark;
+  HeapMarkSet(ctx, r, &mark);
+  while(seqNext(ctx, o, &args[1])) {
+    Object* result = functionCall(ctx, fn, 2, args);
+    if(result && NumberP(result)) {
+      ((Number*)ObjectGetDataPtr(box))->value = numberValue(result);
+      result = box;
+      if(HeapRewindForm(ctx, r, &mark) == 0) {
+        HeapMarkSet(ctx, r, &mark);
+      }
+    }
+    else {
+      HeapMarkSet(ctx, r, &mark);
+    }
+    args[0] = result;
+    ContextYield(ctx);
+  }
+  return args[0];
+}
+
+// (seq-print s) prints every element of s on a line of its own.
+static Object* SeqPrint(Context* ctx, Object* o) {
+  Reader* r = seqReader(o);
+  HeapMark mark;
+  HeapMarkSet(ctx, r, &mark);
+  Object* element;
+  while(seqNext(ctx, o, &element)) {
+    if(!element) {
+      fputs("nil", stdout);
+    }
+    else if(ObjectGetType(element)->printFn) {
+      ObjectGetType(element)->printFn->fn1(ctx, element);
+    }
+    fputc('\n', stdout);
+    ContextYield(ctx);
+    if(HeapRewindForm(ctx, r, &mark) == 0) {
+      HeapMarkSet(ctx, r, &mark);
+    }
+  }
+  return NULL;
+}
+
+// (seq-list s) realises all of s into a list. Only for sequences known to be
+// short, such as the result of seq-take.
+static Object* SeqList(Context* ctx, Object* o) {
+  unsigned int nArgs = 0;
+  Object* element;
+  while(seqNext(ctx, o, &element)) {
+    StackPush(ctx->stack, element);
+    ++nArgs;
+  }
+  return ListMake(ctx, nArgs);
+}
+
+static Object* SeqPrintSelf(Context* ctx, Object* o) {
+  seqData(o);
+  fputs("#<Seq>", stdout);
+  return NULL;
+}
+
+static Function fSeqRead;
+static Function fSeqDelete;
+static Function fSeqMap;
+static Function fSeqFilter;
+static Function fSeqTake;
+static Function fSeqCount;
+static Function fSeqReduce;
+static Function fSeqPrint;
+static Function fSeqList;
+static Function fSeqPrintSelf;
+
+static Object* Write(Context* ctx, Object* o);
+static Object* WriteTo(Context* ctx, Object* form);
+
+static Function fWrite;
+static Function fWriteTo;
+
+static void initBuiltins() {
+  // TODO: make thread safe
+  static int initDone = 0;
+  if(initDone) {
+    return;
+  }
+  initDone = 1;
+
+  // Number
+
+  tNumber.alignment = sizeof(double);
+  tNumber.nFields = 0;
+  tNumber.size = sizeof(Number);
+  tNumber.fields = NULL;
+  tNumber.name = "Number";
+  TypeRegister(&tNumber);
 
   tNumber.deleteFn = NULL;
   tNumber.evalFn = NULL;
 
   fNumberPrint.name = "number-print";
   fNumberPrint.isBuiltIn = 1;
-  fNumberPrint.builtIn = &NumberPrint;
+  fNumberPrint.arity = 1;
+  fNumberPrint.fn1 = &NumberPrint;
   tNumber.printFn = &fNumberPrint;
 
+  fNumberAdd.name = "+";
+  fNumberAdd.isBuiltIn = 1;
+  fNumberAdd.isPure = 1;
+  fNumberAdd.arity = 2;
+  fNumberAdd.fn2 = &NumberAdd;
+  fNumberAdd.numberFn = &addDoubles;
+
+  fNumberSub.name = "-";
+  fNumberSub.isBuiltIn = 1;
+  fNumberSub.isPure = 1;
+  fNumberSub.arity = 2;
+  fNumberSub.fn2 = &NumberSub;
+  fNumberSub.numberFn = &subDoubles;
+
+  fNumberMul.name = "*";
+  fNumberMul.isBuiltIn = 1;
+  fNumberMul.isPure = 1;
+  fNumberMul.arity = 2;
+  fNumberMul.fn2 = &NumberMul;
+  fNumberMul.numberFn = &mulDoubles;
+
+  fNumberDiv.name = "/";
+  fNumberDiv.isBuiltIn = 1;
+  fNumberDiv.isPure = 1;
+  fNumberDiv.arity = 2;
+  fNumberDiv.fn2 = &NumberDiv;
+  fNumberDiv.numberFn = &divDoubles;
+
+  fIsNumber.name = "number?";
+  fIsNumber.isBuiltIn = 1;
+  fIsNumber.isPure = 1;
+  fIsNumber.arity = 1;
+  fIsNumber.fn1 = &IsNumber;
+
   // Symbol
 
   tSymbol.alignment = sizeof(void*);
@@ -570,22 +2658,28 @@ static void initBuiltins() {
   tSymbol.size = sizeof(Symbol);
   tSymbol.fields = NULL;
   tSymbol.name = "Symbol";
+  TypeRegister(&tSymbol);
 
-  fSymbolDelete.name = "symbol-delete";
-  fSymbolDelete.isBuiltIn = 1;
-  fSymbolDelete.builtIn = &SymbolDelete;
-  tSymbol.deleteFn = &fSymbolDelete;
+  tSymbol.deleteFn = NULL;
 
   fSymbolPrint.name = "symbol-print";
   fSymbolPrint.isBuiltIn = 1;
-  fSymbolPrint.builtIn = &SymbolPrint;
+  fSymbolPrint.arity = 1;
+  fSymbolPrint.fn1 = &SymbolPrint;
   tSymbol.printFn = &fSymbolPrint;
 
   fSymbolEval.name = "symbol-eval";
   fSymbolEval.isBuiltIn = 1;
-  fSymbolEval.builtIn = &SymbolEval;
+  fSymbolEval.arity = 1;
+  fSymbolEval.fn1 = &SymbolEval;
   tSymbol.evalFn = &fSymbolEval;
 
+  fIsSymbol.name = "symbol?";
+  fIsSymbol.isBuiltIn = 1;
+  fIsSymbol.isPure = 1;
+  fIsSymbol.arity = 1;
+  fIsSymbol.fn1 = &IsSymbol;
+
   // List
 
   tList.alignment = sizeof(void*);
@@ -593,15 +2687,33 @@ static void initBuiltins() {
   tList.size = sizeof(List);
   tList.fields = NULL;
   tList.name = "List";
+  TypeRegister(&tList);
 
   tList.deleteFn = NULL;
-  tList.evalFn = NULL;
 
   fListPrint.name = "list-print";
   fListPrint.isBuiltIn = 1;
-  fListPrint.builtIn = &ListPrint;
+  fListPrint.arity = 1;
+  fListPrint.fn1 = &ListPrint;
   tList.printFn = &fListPrint;
 
+  fListEval.name = "list-eval";
+  fListEval.isBuiltIn = 1;
+  fListEval.arity = 1;
+  fListEval.fn1 = &ListEval;
+  tList.evalFn = &fListEval;
+
+  fListMake.name = "list";
+  fListMake.isBuiltIn = 1;
+  fListMake.arity = ARITY_VARIADIC;
+  fListMake.builtIn = &ListMake;
+
+  fIsList.name = "list?";
+  fIsList.isBuiltIn = 1;
+  fIsList.isPure = 1;
+  fIsList.arity = 1;
+  fIsList.fn1 = &IsList;
+
   // Function
 
   tFunction.alignment = sizeof(void*);
@@ -609,14 +2721,206 @@ static void initBuiltins() {
   tFunction.size = sizeof(Function);
   tFunction.fields = NULL;
   tFunction.name = "Function";
+  TypeRegister(&tFunction);
 
   tFunction.deleteFn = NULL;
   tFunction.evalFn = NULL;
 
   fFunctionPrint.name = "function-print";
   fFunctionPrint.isBuiltIn = 1;
-  fFunctionPrint.builtIn = &FunctionPrint;
+  fFunctionPrint.arity = 1;
+  fFunctionPrint.fn1 = &FunctionPrint;
   tFunction.printFn = &fFunctionPrint;
+
+  fIsFunction.name = "function?";
+  fIsFunction.isBuiltIn = 1;
+  fIsFunction.isPure = 1;
+  fIsFunction.arity = 1;
+  fIsFunction.fn1 = &IsFunction;
+
+  // Records
+
+  fRecordPrint.name = "record-print";
+  fRecordPrint.isBuiltIn = 1;
+  fRecordPrint.arity = 1;
+  fRecordPrint.fn1 = &RecordPrint;
+
+  fDefRecord.name = "defrecord";
+  fDefRecord.isBuiltIn = 1;
+  fDefRecord.isSpecial = 1;
+  fDefRecord.arity = 1;
+  fDefRecord.fn1 = &DefRecord;
+
+  // Table
+
+  tTable.alignment = sizeof(void*);
+  tTable.nFields = 0;
+  tTable.size = sizeof(Table);
+  tTable.fields = NULL;
+  tTable.name = "Table";
+  TypeRegister(&tTable);
+
+  tTable.evalFn = NULL;
+
+  fTableDelete.name = "table-delete";
+  fTableDelete.isBuiltIn = 1;
+  fTableDelete.arity = 1;
+  fTableDelete.fn1 = &TableDelete;
+  tTable.deleteFn = &fTableDelete;
+
+  fTablePrint.name = "table-print";
+  fTablePrint.isBuiltIn = 1;
+  fTablePrint.arity = 1;
+  fTablePrint.fn1 = &TablePrint;
+  tTable.printFn = &fTablePrint;
+
+  fTableNew.name = "table";
+  fTableNew.isBuiltIn = 1;
+  fTableNew.arity = 1;
+  fTableNew.fn1 = &TableNew;
+
+  fTableAdd.name = "table-add";
+  fTableAdd.isBuiltIn = 1;
+  fTableAdd.arity = 2;
+  fTableAdd.fn2 = &TableAdd;
+
+  fTableCount.name = "table-count";
+  fTableCount.isBuiltIn = 1;
+  fTableCount.arity = 1;
+  fTableCount.fn1 = &TableCount;
+
+  fTableGet.name = "table-get";
+  fTableGet.isBuiltIn = 1;
+  fTableGet.arity = 2;
+  fTableGet.fn2 = &TableGet;
+
+  fTableSum.name = "table-sum";
+  fTableSum.isBuiltIn = 1;
+  fTableSum.arity = 2;
+  fTableSum.fn2 = &TableSum;
+
+  // Seq
+
+  tSeq.alignment = sizeof(double);
+  tSeq.nFields = 0;
+  tSeq.size = sizeof(Seq);
+  tSeq.fields = NULL;
+  tSeq.name = "Seq";
+  TypeRegister(&tSeq);
+
+  tSeq.evalFn = NULL;
+
+  fSeqDelete.name = "seq-delete";
+  fSeqDelete.isBuiltIn = 1;
+  fSeqDelete.arity = 1;
+  fSeqDelete.fn1 = &SeqDelete;
+  tSeq.deleteFn = &fSeqDelete;
+
+  fSeqPrintSelf.name = "seq-print-self";
+  fSeqPrintSelf.isBuiltIn = 1;
+  fSeqPrintSelf.arity = 1;
+  fSeqPrintSelf.fn1 = &SeqPrintSelf;
+  tSeq.printFn = &fSeqPrintSelf;
+
+  fSeqRead.name = "read-seq";
+  fSeqRead.isBuiltIn = 1;
+  fSeqRead.isSpecial = 1;
+  fSeqRead.arity = 1;
+  fSeqRead.fn1 = &SeqRead;
+
+  fSeqMap.name = "seq-map";
+  fSeqMap.isBuiltIn = 1;
+  fSeqMap.arity = 2;
+  fSeqMap.fn2 = &SeqMap;
+
+  fSeqFilter.name = "seq-filter";
+  fSeqFilter.isBuiltIn = 1;
+  fSeqFilter.arity = 2;
+  fSeqFilter.fn2 = &SeqFilter;
+
+  fSeqTake.name = "seq-take";
+  fSeqTake.isBuiltIn = 1;
+  fSeqTake.arity = 2;
+  fSeqTake.fn2 = &SeqTake;
+
+  fSeqCount.name = "seq-count";
+  fSeqCount.isBuiltIn = 1;
+  fSeqCount.arity = 1;
+  fSeqCount.fn1 = &SeqCount;
+
+  fSeqReduce.name = "seq-reduce";
+  fSeqReduce.isBuiltIn = 1;
+  fSeqReduce.arity = 3;
+  fSeqReduce.fn3 = &SeqReduce;
+
+  fSeqPrint.name = "seq-print";
+  fSeqPrint.isBuiltIn = 1;
+  fSeqPrint.arity = 1;
+  fSeqPrint.fn1 = &SeqPrint;
+
+  fSeqList.name = "seq-list";
+  fSeqList.isBuiltIn = 1;
+  fSeqList.arity = 1;
+  fSeqList.fn1 = &SeqList;
+
+  // Task
+
+  fYield.name = "yield";
+  fYield.isBuiltIn = 1;
+  fYield.arity = 0;
+  fYield.fn0 = &Yield;
+
+  fSpawn.name = "spawn";
+  fSpawn.isBuiltIn = 1;
+  fSpawn.isSpecial = 1;
+  fSpawn.arity = 1;
+  fSpawn.fn1 = &Spawn;
+
+  // Serialization
+
+  fWrite.name = "write";
+  fWrite.isBuiltIn = 1;
+  fWrite.arity = 1;
+  fWrite.fn1 = &Write;
+
+  fWriteTo.name = "write-to";
+  fWriteTo.isBuiltIn = 1;
+  fWriteTo.isSpecial = 1;
+  fWriteTo.arity = 1;
+  fWriteTo.fn1 = &WriteTo;
+}
+
+// Makes a builtin callable from code by binding it under its name in the
+// runtime environment.
+static int RuntimeBindBuiltIn(Runtime* rt, Function* f) {
+  if(rt->nBuiltIns == rt->builtInListSize) {
+    unsigned int newSize = rt->builtInListSize ? rt->builtInListSize * 2 : 32;
+    Object** newBuiltIns = (Object**)realloc(rt->builtIns, sizeof(Object*) * newSize);
+    if(!newBuiltIns) {
+      return 0;
+    }
+    rt->builtInListSize = newSize;
+    rt->builtIns = newBuiltIns;
+  }
+  // Builtins outlive every context, so they are not allocated in a context
+  // heap but in chunks of the runtime's own.
+  unsigned long long size = ObjectSize(&tFunction);
+  HeapChunk* chunk = rt->builtInHeap;
+  if(!chunk || chunk->used + size > chunk->size) {
+    chunk = HeapChunkNew(size);
+    if(!chunk) {
+      return 0;
+    }
+    chunk->next = rt->builtInHeap;
+    rt->builtInHeap = chunk;
+  }
+  Object* o = (Object*)&chunk->data[chunk->used];
+  chunk->used += size;
+  o->header = tFunction.id << 1;
+  *(Function*)ObjectGetDataPtr(o) = *f;
+  rt->builtIns[rt->nBuiltIns++] = o;
+  EnvironmentBind(rt->environment, f->name, o);
+  return 1;
 }
 
 static Runtime* RuntimeNew(StreamType inputType, const char* strOrFileName) {
@@ -630,12 +2934,30 @@ static Runtime* RuntimeNew(StreamType inputType, const char* strOrFileName) {
   rt->nContexts = 1;
   rt->contextListSize = 100;
   rt->contexts = NULL;
+  rt->freeContexts = NULL;
+  rt->nBuiltIns = 0;
+  rt->builtInListSize = 0;
+  rt->builtIns = NULL;
+  rt->builtInHeap = NULL;
 
   rt->environment = EnvironmentNew(NULL);
-  if(!rt->environment) {
+  if(!rt->environment || !heapRegionReserve()) {
     goto cleanup;
   }
 
+  Function* builtIns[] = {
+    &fNumberAdd, &fNumberSub, &fNumberMul, &fNumberDiv, &fIsNumber,
+    &fIsSymbol, &fListMake, &fIsList, &fIsFunction, &fDefRecord,
+    &fTableNew, &fTableAdd, &fTableCount, &fTableGet, &fTableSum,
+    &fSeqRead, &fSeqMap, &fSeqFilter, &fSeqTake, &fSeqCount, &fSeqReduce,
+    &fSeqPrint, &fSeqList, &fYield, &fSpawn, &fWrite, &fWriteTo
+  };
+  for(unsigned int i = 0; i < sizeof(builtIns) / sizeof(Function*); ++i) {
+    if(!RuntimeBindBuiltIn(rt, builtIns[i])) {
+      goto cleanup;
+    }
+  }
+
   rt->contexts = (Context**)malloc(sizeof(Context*) * rt->contextListSize);
   if(!rt->contexts) {
     goto cleanup;
@@ -658,6 +2980,8 @@ static Runtime* RuntimeNew(StreamType inputType, const char* strOrFileName) {
   if(rt) {
     free(rt->contexts);
     EnvironmentDelete(rt->environment);
+    HeapChunkDelete(rt->builtInHeap);
+    free(rt->builtIns);
     free(rt);
     rt = NULL;
   }
@@ -666,6 +2990,51 @@ static Runtime* RuntimeNew(StreamType inputType, const char* strOrFileName) {
   return rt;
 }
 
+// Hands ownership of the context to the runtime.
+static int RuntimeAddContext(Runtime* rt, Context* ctx) {
+  if(rt->nContexts == rt->contextListSize) {
+    unsigned int newSize = rt->contextListSize * 2;
+    Context** newContexts = (Context**)realloc(rt->contexts, sizeof(Context*) * newSize);
+    if(!newContexts) {
+      return 0;
+    }
+    for(unsigned int i = rt->contextListSize; i < newSize; ++i) {
+      newContexts[i] = NULL;
+    }
+    rt->contextListSize = newSize;
+    rt->contexts = newContexts;
+  }
+  rt->contexts[rt->nContexts++] = ctx;
+  return 1;
+}
+
+// Returns a context reading from str. Contexts handed back with
+// RuntimeReleaseContext are reset and reused, so serving many small
+// evaluations does not pay for creating and deleting a context each time.
+static Context* RuntimeAcquireContext(Runtime* rt, const char* str) {
+  Context* ctx = rt->freeContexts;
+  if(ctx) {
+    rt->freeContexts = ctx->nextFree;
+    ctx->nextFree = NULL;
+    if(!ContextReset(ctx, str)) {
+      return NULL; // TODO: return error
+    }
+    return ctx;
+  }
+
+  ctx = ContextNew(rt, ST_STRING, str);
+  if(!ctx || !RuntimeAddContext(rt, ctx)) {
+    ContextDelete(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+static void RuntimeReleaseContext(Runtime* rt, Context* ctx) {
+  ctx->nextFree = rt->freeContexts;
+  rt->freeContexts = ctx;
+}
+
 static void RuntimeDelete(Runtime* rt) {
   if(!rt) {
     return;
@@ -677,19 +3046,340 @@ static void RuntimeDelete(Runtime* rt) {
   free(rt->contexts);
 
   EnvironmentDelete(rt->environment);
+  HeapChunkDelete(rt->builtInHeap);
+  free(rt->builtIns);
   free(rt);
 }
 
+// I/O event loop
+
+// ST_FILE streams read through an event loop shared by all streams of a
+// thread. Reads are queued on an io_uring and submitted in batches. Where
+// io_uring is not available pipes and sockets are read when epoll reports them
+// readable, and regular files, which epoll does not support, are read directly.
+// Every stream keeps one read in flight ahead of the block being consumed.
+// A task that has to wait for its read lets the other tasks of its context
+// run, and the thread only blocks once all of them are waiting.
+
+
+static int ioUringSetup(void) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &p);
+  if(fd < 0) {
+    return 0;
+  }
+  char* sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  char* cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    // Mappings of a closed ring are only address space, left as they are.
+    close(fd);
+    return 0;
+  }
+  ioLoop.ringFd = fd;
+  ioLoop.sqEntries = p.sq_entries;
+  ioLoop.sqHead = (unsigned int*)(sq + p.sq_off.head);
+  ioLoop.sqTail = (unsigned int*)(sq + p.sq_off.tail);
+  ioLoop.sqMask = (unsigned int*)(sq + p.sq_off.ring_mask);
+  ioLoop.sqArray = (unsigned int*)(sq + p.sq_off.array);
+  ioLoop.sqes = sqes;
+  ioLoop.cqHead = (unsigned int*)(cq + p.cq_off.head);
+  ioLoop.cqTail = (unsigned int*)(cq + p.cq_off.tail);
+  ioLoop.cqMask = (unsigned int*)(cq + p.cq_off.ring_mask);
+  ioLoop.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+static void ioLoopInit(void) {
+  if(ioLoop.initialized) {
+    return;
+  }
+  ioLoop.initialized = 1;
+  ioLoop.ringFd = -1;
+  ioLoop.epollFd = -1;
+  if(!ioUringSetup()) {
+    ioLoop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+  }
+}
+
+// Submits queued entries and waits for at least minComplete completions.
+static void ioUringEnter(unsigned int minComplete) {
+  int result = syscall(__NR_io_uring_enter, ioLoop.ringFd, ioLoop.nQueued, minComplete,
+                       minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if(result < 0 && errno != EINTR) {
+    abort(); // TODO: return error
+  }
+  if(result > 0) {
+    ioLoop.nQueued -= (unsigned int)result < ioLoop.nQueued ? (unsigned int)result : ioLoop.nQueued;
+  }
+}
+
+static struct io_uring_sqe* ioUringGetSqe(void) {
+  unsigned int tail = *ioLoop.sqTail;
+  if(tail - __atomic_load_n(ioLoop.sqHead, __ATOMIC_ACQUIRE) == ioLoop.sqEntries) {
+    ioUringEnter(0);
+    if(tail - __atomic_load_n(ioLoop.sqHead, __ATOMIC_ACQUIRE) == ioLoop.sqEntries) {
+      abort(); // TODO: return error
+    }
+  }
+  unsigned int index = tail & *ioLoop.sqMask;
+  struct io_uring_sqe* sqe = &ioLoop.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ioLoop.sqArray[index] = index;
+  return sqe;
+}
+
+static void ioUringQueue(void) {
+  __atomic_store_n(ioLoop.sqTail, *ioLoop.sqTail + 1, __ATOMIC_RELEASE);
+  ++ioLoop.nQueued;
+}
+
+static void streamReadDone(Stream* s, int result) {
+  s->readPending = 0;
+  s->readResult = result;
+  ++ioLoop.nCompleted;
+}
+
+// Reads into the stream's spare buffer without blocking. Returns 0 if the
+// descriptor has nothing to read yet.
+static int streamTryRead(Stream* s) {
+  int result = read(s->fd, s->nextBuffer, STREAM_BUFFER_SIZE);
+  if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  streamReadDone(s, result);
+  return 1;
+}
+
+// Starts reading the next block of the file into the stream's spare buffer.
+static void streamSubmitRead(Stream* s) {
+  s->readPending = 1;
+  if(ioLoop.ringFd != -1) {
+    struct io_uring_sqe* sqe = ioUringGetSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = s->fd;
+    sqe->addr = (uintptr_t)s->nextBuffer;
+    sqe->len = STREAM_BUFFER_SIZE;
+    sqe->off = s->isRegular ? s->fileOffset : (unsigned long long)-1;
+    sqe->user_data = (uintptr_t)s;
+    ioUringQueue();
+  }
+  else if(s->isRegular || streamTryRead(s) || ioLoop.epollFd == -1) {
+    if(s->readPending) {
+      // Regular files are always ready, and without epoll there is nothing
+      // to wait with.
+      streamReadDone(s, pread(s->fd, s->nextBuffer, STREAM_BUFFER_SIZE, s->fileOffset));
+      if(!s->isRegular && s->readResult < 0 && errno == ESPIPE) {
+        streamReadDone(s, read(s->fd, s->nextBuffer, STREAM_BUFFER_SIZE));
+      }
+    }
+  }
+  else {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = s;
+    if(epoll_ctl(ioLoop.epollFd, s->polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &event) != 0) {
+      abort(); // TODO: return error
+    }
+    s->polled = 1;
+  }
+}
+
+// Submits queued reads and handles completed ones, waiting for at least one
+// if block is set.
+static void ioLoopPoll(int block) {
+  if(ioLoop.ringFd != -1) {
+    if(ioLoop.nQueued || block) {
+      ioUringEnter(block ? 1 : 0);
+    }
+    unsigned int head = *ioLoop.cqHead;
+    unsigned int tail = __atomic_load_n(ioLoop.cqTail, __ATOMIC_ACQUIRE);
+    for(; head != tail; ++head) {
+      struct io_uring_cqe* cqe = &ioLoop.cqes[head & *ioLoop.cqMask];
+      if(cqe->user_data) {
+        streamReadDone((Stream*)(uintptr_t)cqe->user_data, cqe->res);
+      }
+    }
+    __atomic_store_n(ioLoop.cqHead, head, __ATOMIC_RELEASE);
+  }
+  else if(ioLoop.epollFd != -1) {
+    struct epoll_event events[64];
+    int n = epoll_wait(ioLoop.epollFd, events, 64, block ? -1 : 0);
+    for(int i = 0; i < n; ++i) {
+      Stream* s = events[i].data.ptr;
+      if(s->readPending && !streamTryRead(s)) {
+        streamSubmitRead(s);
+      }
+    }
+  }
+}
+
+static void ContextYield(Context* ctx);
+
+// Waits for the stream's read in flight to complete, running other tasks of
+// the context that is reading meanwhile.
+static void streamWaitRead(Stream* s) {
+  Context* ctx = ioLoop.ctx;
+  unsigned long long seen = ioLoop.nCompleted;
+  while(s->readPending) {
+    ioLoopPoll(0);
+    if(!s->readPending) {
+      break;
+    }
+    if(!ctx || ctx->currentTask->next == ctx->currentTask) {
+      ioLoopPoll(1);
+      continue;
+    }
+    // Block only if every other task waits as well, and nothing completed
+    // since they last looked.
+    if(ctx->nWaiting == ctx->nTasks && ioLoop.nCompleted == seen) {
+      ioLoopPoll(1);
+    }
+    seen = ioLoop.nCompleted;
+    ++ctx->nWaiting;
+    ContextYield(ctx);
+    --ctx->nWaiting;
+  }
+}
+
+// Waits for a read in flight before the stream goes away, cancelling it since
+// a pipe may never become readable.
+static void streamCancelRead(Stream* s) {
+  if(!s->readPending) {
+    return;
+  }
+  if(ioLoop.ringFd != -1) {
+    struct io_uring_sqe* sqe = ioUringGetSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)s;
+    ioUringQueue();
+    while(s->readPending) {
+      ioLoopPoll(1);
+    }
+  }
+  else {
+    epoll_ctl(ioLoop.epollFd, EPOLL_CTL_DEL, s->fd, NULL);
+    s->readPending = 0;
+  }
+}
+
+// Makes the block read ahead the current one. Returns 0 if there is no more input.
+static int StreamFill(Stream* s) {
+  if(s->eof) {
+    return 0;
+  }
+  if(s->busy) {
+    abort(); // TODO: error; stream read by two tasks at once
+  }
+  s->busy = 1;
+  if(!s->readPending) {
+    streamSubmitRead(s);
+  }
+  streamWaitRead(s);
+  s->busy = 0;
+  if(s->readResult <= 0) {
+    // TODO: report read errors instead of treating them as the end
+    s->eof = 1;
+    return 0;
+  }
+  char* filled = s->nextBuffer;
+  s->nextBuffer = s->buffer;
+  s->buffer = filled;
+  s->bufferPos = 0;
+  s->bufferEnd = s->readResult;
+  s->fileOffset += s->readResult;
+  streamSubmitRead(s);
+  return 1;
+}
+
 static int StreamEnd(Stream* s) {
   if(s->type == ST_STRING) {
     return s->string[s->stringPos] == 0;
   }
   else if(s->type == ST_FILE) {
-    return feof(s->file);
+    return s->bufferPos == s->bufferEnd && !StreamFill(s);
+  }
+  else if(s->type == ST_MAPPED || s->type == ST_MEMORY) {
+    return s->mappedPos == s->mappedSize;
+  }
+  abort();
+}
+
+// Consumes the prefix and returns 1 if the stream starts with it, otherwise
+// leaves the stream untouched and returns 0. Only valid before anything has
+// been read from the stream.
+static int StreamSkipPrefix(Stream* s, const char* prefix, unsigned int len) {
+  if(StreamEnd(s)) {
+    return 0;
+  }
+  if(s->type == ST_STRING) {
+    if(strncmp(s->string, prefix, len) == 0) {
+      s->stringPos += len;
+      return 1;
+    }
+    return 0;
+  }
+  else if(s->type == ST_FILE) {
+    if(s->bufferEnd - s->bufferPos >= len &&
+       memcmp(s->buffer + s->bufferPos, prefix, len) == 0) {
+      s->bufferPos += len;
+      return 1;
+    }
+    return 0;
+  }
+  else if(s->type == ST_MAPPED || s->type == ST_MEMORY) {
+    if(s->mappedSize - s->mappedPos >= len &&
+       memcmp(s->mapped + s->mappedPos, prefix, len) == 0) {
+      s->mappedPos += len;
+      return 1;
+    }
+    return 0;
   }
   abort();
 }
 
+// Reads up to len bytes into dest. Returns the number of bytes read, which is
+// less than len only at the end of input.
+static unsigned int StreamRead(Stream* s, char* dest, unsigned int len) {
+  unsigned int done = 0;
+  while(done < len && !StreamEnd(s)) {
+    unsigned int available;
+    const char* src;
+    if(s->type == ST_STRING) {
+      src = s->string + s->stringPos;
+      available = strlen(src);
+    }
+    else if(s->type == ST_FILE) {
+      src = s->buffer + s->bufferPos;
+      available = s->bufferEnd - s->bufferPos;
+    }
+    else if(s->type == ST_MAPPED || s->type == ST_MEMORY) {
+      src = s->mapped + s->mappedPos;
+      available = s->mappedSize - s->mappedPos < len - done ? s->mappedSize - s->mappedPos : len - done;
+    }
+    else {
+      abort();
+    }
+    unsigned int n = len - done < available ? len - done : available;
+    memcpy(dest + done, src, n);
+    if(s->type == ST_STRING) {
+      s->stringPos += n;
+    }
+    else if(s->type == ST_FILE) {
+      s->bufferPos += n;
+    }
+    else {
+      s->mappedPos += n;
+    }
+    done += n;
+  }
+  return done;
+}
+
 // Returns a value between 0 and 255, or -1 on end of input.
 static int StreamGet(Stream* s) {
   if(StreamEnd(s)) {
@@ -699,7 +3389,10 @@ static int StreamGet(Stream* s) {
     return s->string[s->stringPos++];
   }
   else if(s->type == ST_FILE) {
-    return fgetc(s->file);
+    return (unsigned char)s->buffer[s->bufferPos++];
+  }
+  else if(s->type == ST_MAPPED || s->type == ST_MEMORY) {
+    return (unsigned char)s->mapped[s->mappedPos++];
   }
   abort();
 }
@@ -710,7 +3403,8 @@ static const char* TokenizerNext(Tokenizer* tokenizer) {
   const char ws[] = " \n\r\t\v\b\f"; // 7
   const char delims[] = "()[]{}"; // 6
 
-  if(StreamEnd(tokenizer->stream)) {
+  // The stream may be at its end with the last character still in c.
+  if(tokenizer->c == -1) {
     return NULL;
   }
 
@@ -771,34 +3465,186 @@ static const char* TokenizerNext(Tokenizer* tokenizer) {
 }
 
 static Object* ObjectAllocRaw(Context* ctx, Type* type) {
-  Object* o = malloc(sizeof(Object) + sizeof(void*) + type->alignment - 1 + type->size);
+  Object* o = HeapAlloc(ctx, ObjectSize(type));
   if(!o) {
     return NULL;
   }
 
-  o->type = type;
-  o->next = ctx->lastObject;
-  o->marked = 0;
+  o->header = type->id << 1;
+
+  if(type->deleteFn) {
+    ++ctx->nFinalizable;
+  }
+
+  return o;
+}
+
+static Object* ReaderReadInternal(Context* ctx, Reader* r);
+
+static unsigned long long hashBytes(unsigned long long hash, const void* bytes, unsigned int len) {
+  // FNV-1a
+  for(unsigned int i = 0; i < len; ++i) {
+    hash ^= ((const unsigned char*)bytes)[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static unsigned long long internKeyHash(InternKey* key) {
+  unsigned long long hash = hashBytes(14695981039346656037ull, &key->type, sizeof(Type*));
+  if(key->type == &tNumber) {
+    return hashBytes(hash, &key->number, sizeof(double));
+  }
+  else if(key->type == &tSymbol) {
+    return hashBytes(hash, key->name, strlen(key->name));
+  }
+  // List cells are interned after their elements and tail, so comparing
+  // those by identity is the same as comparing structurally.
+  hash = hashBytes(hash, &key->value, sizeof(Object*));
+  return hashBytes(hash, &key->next, sizeof(Object*));
+}
+
+static int internKeyMatch(InternKey* key, Object* o) {
+  if(ObjectGetType(o) != key->type) {
+    return 0;
+  }
+  if(key->type == &tNumber) {
+    return memcmp(&((Number*)ObjectGetDataPtr(o))->value, &key->number, sizeof(double)) == 0;
+  }
+  else if(key->type == &tSymbol) {
+    return strcmp(((Symbol*)ObjectGetDataPtr(o))->name, key->name) == 0;
+  }
+  List* l = ObjectGetDataPtr(o);
+  return RefGet(l->value) == key->value && RefGet(l->next) == key->next;
+}
+
+// Returns the interned object matching key, or NULL if there is none.
+static Object* internFind(Reader* r, InternKey* key, unsigned long long hash) {
+  if(r->nInterned == 0) {
+    return NULL;
+  }
+  unsigned int mask = r->internTableSize - 1;
+  for(unsigned int i = hash & mask; r->internTable[i].object; i = (i + 1) & mask) {
+    if(r->internTable[i].hash == hash && internKeyMatch(key, r->internTable[i].object)) {
+      return r->internTable[i].object;
+    }
+  }
+  return NULL;
+}
+
+static void internAdd(Reader* r, Object* o, unsigned long long hash) {
+  if((r->nInterned + 1) * 4 > r->internTableSize * 3) {
+    unsigned int newSize = r->internTableSize ? r->internTableSize * 2 : 1024;
+    InternEntry* newTable = (InternEntry*)malloc(sizeof(InternEntry) * newSize);
+    if(!newTable) {
+      abort(); // TODO: return error
+    }
+    for(unsigned int i = 0; i < newSize; ++i) {
+      newTable[i].object = NULL;
+    }
+    for(unsigned int i = 0; i < r->internTableSize; ++i) {
+      if(r->internTable[i].object) {
+        unsigned int j = r->internTable[i].hash & (newSize - 1);
+        while(newTable[j].object) {
+          j = (j + 1) & (newSize - 1);
+        }
+        newTable[j] = r->internTable[i];
+      }
+    }
+    free(r->internTable);
+    r->internTable = newTable;
+    r->internTableSize = newSize;
+  }
+  unsigned int mask = r->internTableSize - 1;
+  unsigned int i = hash & mask;
+  while(r->internTable[i].object) {
+    i = (i + 1) & mask;
+  }
+  r->internTable[i].hash = hash;
+  r->internTable[i].object = o;
+  ++r->nInterned;
+}
 
-  ctx->lastObject = o;
+// Returns a number object. In intern mode equal numbers share one object.
+static Object* makeNumber(Context* ctx, Reader* r, double value) {
+  InternKey key;
+  unsigned long long hash = 0;
+  if(r->intern) {
+    key.type = &tNumber;
+    key.number = value;
+    hash = internKeyHash(&key);
+    Object* found = internFind(r, &key, hash);
+    if(found) {
+      return found;
+    }
+  }
+  Object* result = ObjectAllocRaw(ctx, &tNumber);
+  if(!result) {
+    abort(); // TODO: return error
+  }
+  Number* n = ObjectGetDataPtr(result);
+  n->value = value;
+  if(r->intern) {
+    internAdd(r, result, hash);
+  }
+  return result;
+}
 
-  return o;
+static Object* SymbolNew(Context* ctx, const char* name);
+
+// Returns a symbol object. In intern mode symbols with the same name share one object.
+static Object* makeSymbol(Context* ctx, Reader* r, const char* name) {
+  InternKey key;
+  unsigned long long hash = 0;
+  if(r->intern) {
+    key.type = &tSymbol;
+    key.name = name;
+    hash = internKeyHash(&key);
+    Object* found = internFind(r, &key, hash);
+    if(found) {
+      return found;
+    }
+  }
+  Object* result = SymbolNew(ctx, name);
+  if(r->intern) {
+    internAdd(r, result, hash);
+  }
+  return result;
 }
 
-static Object* ReaderReadInternal(Context* ctx, Reader* r);
+// Builds an interned list of the elements on the stack above base, popping
+// them. Cells are looked up from the tail up before they are allocated, so a
+// list, or tail of a list, that has been read before costs no allocation.
+// Returns the interned head.
+static Object* internList(Context* ctx, Reader* r, unsigned int base) {
+  Object* next = NULL;
+  do {
+    InternKey key;
+    key.type = &tList;
+    key.value = ctx->stack->top > base ? StackPop(ctx->stack) : NULL;
+    key.next = next;
+    unsigned long long hash = internKeyHash(&key);
+    Object* found = internFind(r, &key, hash);
+    if(!found) {
+      found = ObjectAllocRaw(ctx, &tList);
+      if(!found) {
+        abort(); // TODO: return error
+      }
+      List* l = ObjectGetDataPtr(found);
+      l->value = RefMake(key.value);
+      l->next = RefMake(next);
+      internAdd(r, found, hash);
+    }
+    next = found;
+  } while(ctx->stack->top > base);
+  return next;
+}
 
-static Object* readNumber(Context* ctx, const char* token) {
-  Object* result;
+static Object* readNumber(Context* ctx, const char* token, Reader* r) {
   char* endptr;
   double number = strtod(token, &endptr);
   if(endptr > token) {
-    result = ObjectAllocRaw(ctx, &tNumber);
-    if(!result) {
-      abort(); // TODO: return error
-    }
-    Number* n = ObjectGetDataPtr(result);
-    n->value = number;
-    return result;
+    return makeNumber(ctx, r, number);
   }
   return NULL;
 }
@@ -811,28 +3657,47 @@ static Object* readList(Context* ctx, const char* token, Reader* r) {
   if(!token) {
     return NULL;
   }
+  if(r->intern) {
+    // The elements stay on the stack until the list is complete, so that
+    // cells that turn out to be duplicates are never allocated.
+    unsigned int base = ctx->stack->top;
+    while(strcmp(token, ")")) {
+      Object* value = ReaderReadInternal(ctx, r);
+      if(!value) {
+        ctx->stack->top = base;
+        return NULL; // TODO: return error; premature end of input
+      }
+      StackPush(ctx->stack, value);
+      token = TokenizerNext(r->tokenizer);
+      if(!token) {
+        ctx->stack->top = base;
+        return NULL;
+      }
+    }
+    return internList(ctx, r, base);
+  }
   Object* headObj = ObjectAllocRaw(ctx, &tList);
   if(!headObj) {
     abort(); // TODO: return error
   }
   List* lst = ObjectGetDataPtr(headObj);
-  lst->value = NULL;
-  lst->next = NULL;
+  lst->value = 0;
+  lst->next = 0;
   while(strcmp(token, ")")) {
     Object* value = ReaderReadInternal(ctx, r);
     if(!value) {
       return NULL; // TODO: return error; premature end of input
     }
     if(lst->value) {
-      lst->next = ObjectAllocRaw(ctx, &tList);
+      lst->next = RefMake(ObjectAllocRaw(ctx, &tList));
       if(!lst->next) {
         abort(); // TODO: return error
       }
-      lst = ObjectGetDataPtr(lst->next);
-      lst->value = NULL;
-      lst->next = NULL;
+      lst = ObjectGetDataPtr(RefGet(lst->next));
+      lst->value = 0;
+      lst->next = 0;
     }
-    lst->value = value;
+    lst->value = RefMake(value);
     token = TokenizerNext(r->tokenizer);
     if(!token) {
       return NULL;
@@ -848,7 +3713,7 @@ static Object* SymbolNew(Context* ctx, const char* name) {
   }
   Symbol* sym = ObjectGetDataPtr(symObj);
   unsigned int len = strlen(name);
-  sym->name = malloc(len + 1);
+  sym->name = ContextAlloc(ctx, len + 1);
   if(!sym->name) {
     abort(); // TODO: return error
   }
@@ -857,25 +3722,164 @@ static Object* SymbolNew(Context* ctx, const char* name) {
   return symObj;
 }
 
-static Object* readSymbol(Context* ctx, const char* token) {
-  return SymbolNew(ctx, token);
+static Object* readSymbol(Context* ctx, const char* token, Reader* r) {
+  return makeSymbol(ctx, r, token);
 }
 
 static Object* ReaderReadInternal(Context* ctx, Reader* r) {
   const char* token = r->tokenizer->token;
-  Object* result = readNumber(ctx, token);
+  Object* result = readNumber(ctx, token, r);
   if(!result) {
     result = readList(ctx, token, r);
   }
   if(!result) {
-    result = readSymbol(ctx, token);
+    result = readSymbol(ctx, token, r);
   }
 
   return result;
 }
 
+static int readVarint(Stream* s, unsigned long long* out) {
+  unsigned long long value = 0;
+  for(unsigned int shift = 0; shift < 64; shift += 7) {
+    int byte = StreamGet(s);
+    if(byte == -1) {
+      return 0;
+    }
+    value |= (unsigned long long)(byte & 0x7f) << shift;
+    if(!(byte & 0x80)) {
+      *out = value;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int readU32(Stream* s, unsigned int* out) {
+  unsigned long long value;
+  if(!readVarint(s, &value) || value > 0xffffffffull) {
+    return 0;
+  }
+  *out = (unsigned int)value;
+  return 1;
+}
+
+static Object* ReaderReadBinary(Context* ctx, Reader* r) {
+  Stream* s = r->tokenizer->stream;
+  int tag = StreamGet(s);
+  unsigned int n;
+  if(tag == -1) {
+    return NULL;
+  }
+
+  if(tag == BT_NUMBER || tag == BT_INTEGER) {
+    double value;
+    if(tag == BT_NUMBER) {
+      unsigned char bytes[8];
+      if(StreamRead(s, (char*)bytes, 8) != 8) {
+        return NULL; // TODO: return error; premature end of input
+      }
+      unsigned long long bits = decodeU64(bytes);
+      memcpy(&value, &bits, sizeof(double));
+    }
+    else {
+      unsigned long long zigzag;
+      if(!readVarint(s, &zigzag)) {
+        return NULL; // TODO: return error; premature end of input
+      }
+      value = (double)(long long)((zigzag >> 1) ^ -(zigzag & 1));
+    }
+    return makeNumber(ctx, r, value);
+  }
+  else if(tag == BT_SYMBOL_DEF) {
+    Tokenizer* t = r->tokenizer;
+    if(!readU32(s, &n)) {
+      return NULL; // TODO: return error; premature end of input
+    }
+    if(n >= t->tokenSize) {
+      char* newToken = (char*)realloc(t->token, n + 1);
+      if(!newToken) {
+        abort(); // TODO: return error
+      }
+      t->tokenSize = n + 1;
+      t->token = newToken;
+    }
+    if(StreamRead(s, t->token, n) != n) {
+      return NULL; // TODO: return error; premature end of input
+    }
+    t->token[n] = 0;
+    if(r->nSymbols == r->symbolListSize) {
+      unsigned int newSize = r->symbolListSize ? r->symbolListSize * 2 : 100;
+      Object** newSymbols = (Object**)realloc(r->symbols, sizeof(Object*) * newSize);
+      if(!newSymbols) {
+        abort(); // TODO: return error
+      }
+      r->symbolListSize = newSize;
+      r->symbols = newSymbols;
+    }
+    Object* sym = makeSymbol(ctx, r, t->token);
+    r->symbols[r->nSymbols++] = sym;
+    return sym;
+  }
+  else if(tag == BT_SYMBOL_REF) {
+    if(!readU32(s, &n)) {
+      return NULL; // TODO: return error; premature end of input
+    }
+    if(n >= r->nSymbols) {
+      abort(); // TODO: return error; corrupt input
+    }
+    return r->symbols[n];
+  }
+  else if(tag == BT_LIST) {
+    if(!readU32(s, &n)) {
+      return NULL; // TODO: return error; premature end of input
+    }
+    if(r->intern) {
+      unsigned int base = ctx->stack->top;
+      for(unsigned int i = 0; i < n; ++i) {
+        Object* value = ReaderReadBinary(ctx, r);
+        if(!value) {
+          ctx->stack->top = base;
+          return NULL; // TODO: return error; premature end of input
+        }
+        StackPush(ctx->stack, value);
+      }
+      return internList(ctx, r, base);
+    }
+    Object* headObj = ObjectAllocRaw(ctx, &tList);
+    if(!headObj) {
+      abort(); // TODO: return error
+    }
+    List* lst = ObjectGetDataPtr(headObj);
+    lst->value = 0;
+    lst->next = 0;
+    for(unsigned int i = 0; i < n; ++i) {
+      Object* value = ReaderReadBinary(ctx, r);
+      if(!value) {
+        return NULL; // TODO: return error; premature end of input
+      }
+      if(lst->value) {
+        lst->next = RefMake(ObjectAllocRaw(ctx, &tList));
+        if(!lst->next) {
+          abort(); // TODO: return error
+        }
+        lst = ObjectGetDataPtr(RefGet(lst->next));
+        lst->value = 0;
+        lst->next = 0;
+      }
+      lst->value = RefMake(value);
+    }
+    return headObj;
+  }
+
+  abort(); // TODO: return error; corrupt input
+}
+
 // Returns NULL on end of input
 static Object* ReaderRead(Context* ctx, Reader* r) {
+  if(r->binary) {
+    return ReaderReadBinary(ctx, r);
+  }
   const char* token = TokenizerNext(r->tokenizer);
   if(!token) {
     return NULL;
@@ -883,73 +3887,608 @@ static Object* ReaderRead(Context* ctx, Reader* r) {
   return ReaderReadInternal(ctx, r);
 }
 
+// Looks the name up in the context environment and then in its parents.
 static Object* EnvironmentGet(Context* ctx, Symbol* name) {
-  for(unsigned int i = 0; i < ctx->environment->bindingsListSize; ++i) {
-    if(ctx->environment->names[i] && strcmp(ctx->environment->names[i], name->name) == 0) {
-      return ctx->environment->objects[i];
+  for(Environment* env = ctx->environment; env; env = env->parent) {
+    for(unsigned int i = 0; i < env->bindingsListSize; ++i) {
+      if(env->names[i] && strcmp(env->names[i], name->name) == 0) {
+        return env->objects[i];
+      }
     }
   }
   return NULL;
 }
 
 // Returns previous value, or NULL if none
-static Object* EnvironmentBind(Context* ctx, Symbol* name, Object* obj) {
+static Object* EnvironmentBind(Environment* env, const char* name, Object* obj) {
   unsigned int freeSlot = 0;
   char hasFree = 0;
-  for(unsigned int i = 0; i < ctx->environment->bindingsListSize; ++i) {
-    if(!hasFree && ctx->environment->names[i] == NULL) {
+  for(unsigned int i = 0; i < env->bindingsListSize; ++i) {
+    if(!hasFree && env->names[i] == NULL) {
       hasFree = 1;
       freeSlot = i;
     }
-    if(ctx->environment->names[i] &&
-       strcmp(ctx->environment->names[i], name->name) == 0) {
-      Object* previous = ctx->environment->objects[i];
-      ctx->environment->objects[i] = obj;
+    if(env->names[i] &&
+       strcmp(env->names[i], name) == 0) {
+      Object* previous = env->objects[i];
+      env->objects[i] = obj;
       return previous;
     }
   }
   if(!hasFree) {
-    unsigned int newBindingsSize = ctx->environment->bindingsListSize * 2;
-    char** newNames = realloc(ctx->environment->names, newBindingsSize * sizeof(char*));
+    unsigned int newBindingsSize = env->bindingsListSize * 2;
+    char** newNames = realloc(env->names, newBindingsSize * sizeof(char*));
     if(!newNames) {
       abort(); // TODO: error
     }
-    for(unsigned int i = ctx->environment->bindingsListSize; i < newBindingsSize; ++i) {
+    for(unsigned int i = env->bindingsListSize; i < newBindingsSize; ++i) {
       newNames[i] = NULL;
     }
-    Object** newObjects = realloc(ctx->environment->objects, newBindingsSize * sizeof(Object*));
+    env->names = newNames;
+    Object** newObjects = realloc(env->objects, newBindingsSize * sizeof(Object*));
     if(!newObjects) {
       abort(); // TODO: error
     }
     hasFree = 1;
-    freeSlot = ctx->environment->bindingsListSize;
-    ctx->environment->bindingsListSize = newBindingsSize;
-    ctx->environment->names = newNames;
-    ctx->environment->objects = newObjects;
-  }
-  unsigned int nameLen = strlen(name->name);
-  ctx->environment->names[freeSlot] = malloc(nameLen + 1);
-  if(!ctx->environment->names[freeSlot]) {
+    freeSlot = env->bindingsListSize;
+    env->bindingsListSize = newBindingsSize;
+    env->objects = newObjects;
+  }
+  unsigned int nameLen = strlen(name);
+  env->names[freeSlot] = malloc(nameLen + 1);
+  if(!env->names[freeSlot]) {
     abort(); // TODO: error
   }
-  memcpy(ctx->environment->names[freeSlot], name->name, nameLen);
-  ctx->environment->names[freeSlot][nameLen] = 0;
-  ctx->environment->objects[freeSlot] = obj;
+  memcpy(env->names[freeSlot], name, nameLen);
+  env->names[freeSlot][nameLen] = 0;
+  env->objects[freeSlot] = obj;
+  ++env->nBindings;
+  return NULL;
+}
+
+static void writeVarint(Writer* w, unsigned long long value) {
+  while(value >= 0x80) {
+    fputc((value & 0x7f) | 0x80, w->file);
+    value >>= 7;
+  }
+  fputc(value, w->file);
+}
+
+static unsigned long long symbolNameHash(const char* name) {
+  return hashBytes(14695981039346656037ull, name, strlen(name));
+}
+
+// Returns the slot of the symbol table holding name, or the empty slot where
+// it belongs.
+static unsigned int writerFindSymbol(Writer* w, const char* name) {
+  unsigned int mask = w->symbolTableSize - 1;
+  unsigned int i = symbolNameHash(name) & mask;
+  while(w->symbolTable[i] && strcmp(w->symbols[w->symbolTable[i] - 1], name) != 0) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+// Adds the last symbol in symbols to the symbol table.
+static void writerAddSymbol(Writer* w) {
+  if(w->nSymbols * 4 > w->symbolTableSize * 3) {
+    unsigned int newSize = w->symbolTableSize ? w->symbolTableSize * 2 : 1024;
+    unsigned int* newTable = (unsigned int*)calloc(newSize, sizeof(unsigned int));
+    if(!newTable) {
+      abort(); // TODO: return error
+    }
+    free(w->symbolTable);
+    w->symbolTable = newTable;
+    w->symbolTableSize = newSize;
+    for(unsigned int i = 0; i + 1 < w->nSymbols; ++i) {
+      w->symbolTable[writerFindSymbol(w, w->symbols[i])] = i + 1;
+    }
+  }
+  w->symbolTable[writerFindSymbol(w, w->symbols[w->nSymbols - 1])] = w->nSymbols;
+}
+
+// Returns 0 if the object can not be serialized.
+static int WriterWrite(Writer* w, Object* o) {
+  if(NumberP(o)) {
+    Number* num = ObjectGetDataPtr(o);
+    // Integral values in a safe range are stored as varints, which is much
+    // smaller for the common case. Negative zero must stay a double.
+    if(num->value >= -9007199254740992.0 && num->value <= 9007199254740992.0 &&
+       num->value == (double)(long long)num->value &&
+       !(num->value == 0 && 1 / num->value < 0)) {
+      long long i = (long long)num->value;
+      fputc(BT_INTEGER, w->file);
+      writeVarint(w, ((unsigned long long)i << 1) ^ (unsigned long long)(i >> 63));
+      return 1;
+    }
+    unsigned long long bits;
+    unsigned char bytes[8];
+    memcpy(&bits, &num->value, sizeof(double));
+    encodeU64(bits, bytes);
+    fputc(BT_NUMBER, w->file);
+    fwrite(bytes, 1, 8, w->file);
+    return 1;
+  }
+  else if(SymbolP(o)) {
+    Symbol* sym = ObjectGetDataPtr(o);
+    if(w->nSymbols) {
+      unsigned int index = w->symbolTable[writerFindSymbol(w, sym->name)];
+      if(index) {
+        fputc(BT_SYMBOL_REF, w->file);
+        writeVarint(w, index - 1);
+        return 1;
+      }
+    }
+    if(w->nSymbols == w->symbolListSize) {
+      unsigned int newSize = w->symbolListSize ? w->symbolListSize * 2 : 100;
+      char** newSymbols = (char**)realloc(w->symbols, sizeof(char*) * newSize);
+      if(!newSymbols) {
+        abort(); // TODO: return error
+      }
+      w->symbolListSize = newSize;
+      w->symbols = newSymbols;
+    }
+    unsigned int len = strlen(sym->name);
+    char* name = malloc(len + 1);
+    if(!name) {
+      abort(); // TODO: return error
+    }
+    memcpy(name, sym->name, len + 1);
+    w->symbols[w->nSymbols++] = name;
+    writerAddSymbol(w);
+    fputc(BT_SYMBOL_DEF, w->file);
+    writeVarint(w, len);
+    fwrite(name, 1, len, w->file);
+    return 1;
+  }
+  else if(ListP(o)) {
+    unsigned int count = 0;
+    List* l = ObjectGetDataPtr(o);
+    while(l && l->value) {
+      ++count;
+      l = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+    }
+    fputc(BT_LIST, w->file);
+    writeVarint(w, count);
+    l = ObjectGetDataPtr(o);
+    while(l && l->value) {
+      if(!WriterWrite(w, RefGet(l->value))) {
+        return 0;
+      }
+      l = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// (write o) appends o to the file opened by write-to, in the binary format.
+// Returns nil.
+static Object* Write(Context* ctx, Object* o) {
+  if(!ctx->writer) {
+    abort(); // TODO: error; no file to write to, see write-to
+  }
+  if(!o || !WriterWrite(ctx->writer, o)) {
+    abort(); // TODO: return error
+  }
+  return NULL;
+}
+
+// (write-to file) creates or truncates file and makes write append to it,
+// closing the file written before. The file name is not evaluated. Returns nil.
+static Object* WriteTo(Context* ctx, Object* form) {
+  List* l = ObjectGetDataPtr(form);
+  List* nameCell = l->next ? ObjectGetDataPtr(RefGet(l->next)) : NULL;
+  if(!nameCell || !nameCell->value || !SymbolP(RefGet(nameCell->value))) {
+    abort(); // TODO: error; needs a file name
+  }
+  WriterDelete(ctx->writer);
+  ctx->writer = WriterNew(((Symbol*)ObjectGetDataPtr(RefGet(nameCell->value)))->name, NULL);
+  if(!ctx->writer) {
+    abort(); // TODO: error; could not open file
+  }
   return NULL;
 }
 
 // Entry point
 
+static void evalPrint(Context* ctx, Object* o) {
+  ioLoop.ctx = ctx;
+  o = FoldForm(ctx, o);
+  Type* type = ObjectGetType(o);
+  if(type->evalFn && type->evalFn->isBuiltIn) {
+    o = type->evalFn->fn1(ctx, o);
+  }
+  ContextRunTasks(ctx);
+  if(!o) {
+    puts("nil");
+  }
+  else if(ObjectGetType(o)->printFn && ObjectGetType(o)->printFn->isBuiltIn) {
+    type = ObjectGetType(o);
+    type->printFn->fn1(ctx, o);
+    putc('\n', stdout);
+  }
+}
+
+// Evaluates and prints every form the context's reader has left.
+static void evalReader(Context* ctx) {
+  Reader* r = ctx->reader;
+  HeapMark mark;
+  HeapMarkSet(ctx, r, &mark);
+  Object* o = ReaderRead(ctx, r);
+  while(o) {
+    evalPrint(ctx, o);
+    if(HeapRewindForm(ctx, r, &mark) == 0) {
+      HeapMarkSet(ctx, r, &mark);
+    }
+    o = ReaderRead(ctx, r);
+  }
+}
+
+// Returns the name of the cache file for a source file, to be freed by the caller.
+static char* moduleCacheName(const char* sourceFileName) {
+  unsigned int len = strlen(sourceFileName);
+  char* name = malloc(len + 6);
+  if(!name) {
+    return NULL;
+  }
+  memcpy(name, sourceFileName, len);
+  if(len >= 4 && strcmp(sourceFileName + len - 4, ".oct") == 0) {
+    strcpy(name + len, "c");
+  }
+  else {
+    strcpy(name + len, ".octc");
+  }
+  return name;
+}
+
+// Makes sure there is an up to date cache for the source file and returns
+// its name, to be freed by the caller. The cache holds everything read from
+// the source in the binary format and is keyed on a hash of the source
+// contents, so it is rebuilt whenever the source changes. Returns NULL if the
+// source is already binary or the cache could not be written.
+static char* ModuleCompile(Runtime* rt, const char* sourceFileName) {
+  Stream* source = StreamNew(ST_MAPPED, sourceFileName);
+  if(!source) {
+    return NULL;
+  }
+  // Binary and cache files are read as they are.
+  if(StreamSkipPrefix(source, CACHE_MAGIC, CACHE_MAGIC_SIZE) ||
+     StreamSkipPrefix(source, BINARY_MAGIC, BINARY_MAGIC_SIZE)) {
+    StreamDelete(source);
+    return NULL;
+  }
+  source->mappedPos = 0;
+  unsigned long long hash = hashBytes(14695981039346656037ull, source->mapped, source->mappedSize);
+  StreamDelete(source);
+
+  char* cacheName = moduleCacheName(sourceFileName);
+  if(!cacheName) {
+    return NULL;
+  }
+
+  Reader* cached = ReaderNew(ST_MAPPED, cacheName);
+  int upToDate = cached && cached->hasSourceHash && cached->binary &&
+    cached->cacheVersion == CACHE_VERSION && cached->sourceHash == hash;
+  ReaderDelete(cached);
+  if(upToDate) {
+    return cacheName;
+  }
+
+  // Write to a temporary file and rename it into place so that a concurrent
+  // load never sees a partial cache. The process id keeps processes that
+  // compile the same source at once from writing to the same file.
+  unsigned int tmpSize = strlen(cacheName) + 32;
+  char* tmpName = malloc(tmpSize);
+  int created = 0;
+  Context* ctx = ContextNew(rt, ST_MAPPED, sourceFileName);
+  if(!tmpName || !ctx) {
+    goto cleanup;
+  }
+  snprintf(tmpName, tmpSize, "%s.%ld.tmp", cacheName, (long)getpid());
+  ctx->writer = WriterNew(tmpName, &hash);
+  if(!ctx->writer) {
+    goto cleanup;
+  }
+  created = 1;
+  HeapMark mark;
+  HeapMarkSet(ctx, ctx->reader, &mark);
+  Object* o = ReaderRead(ctx, ctx->reader);
+  while(o) {
+    if(!WriterWrite(ctx->writer, o)) {
+      goto cleanup;
+    }
+    if(HeapRewindForm(ctx, ctx->reader, &mark) == 0) {
+      HeapMarkSet(ctx, ctx->reader, &mark);
+    }
+    o = ReaderRead(ctx, ctx->reader);
+  }
+  int written = WriterDelete(ctx->writer);
+  ctx->writer = NULL;
+  if(!written || rename(tmpName, cacheName) != 0) {
+    goto cleanup;
+  }
+  ContextDelete(ctx);
+  free(tmpName);
+  return cacheName;
+
+ cleanup:
+  if(created) {
+    remove(tmpName);
+  }
+  ContextDelete(ctx);
+  free(tmpName);
+  free(cacheName);
+  return NULL;
+}
+
+// Returns a new context, owned by the runtime, that reads the forms of the
+// source file. The forms come from the module cache when possible; if the
+// cache can not be written the source is read directly.
+static Context* RuntimeLoad(Runtime* rt, const char* sourceFileName) {
+  char* cacheName = ModuleCompile(rt, sourceFileName);
+  Context* ctx;
+  if(cacheName) {
+    ctx = ContextNew(rt, ST_MAPPED, cacheName);
+    free(cacheName);
+  }
+  else {
+    ctx = ContextNew(rt, ST_MAPPED, sourceFileName);
+  }
+  if(!ctx || !RuntimeAddContext(rt, ctx)) {
+    ContextDelete(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// Parallel reading
+
+typedef struct {
+  Context* ctx;
+  unsigned int nForms;
+  unsigned int formListSize;
+  Object** forms;
+} ReadChunk;
+
+static void* readChunk(void* arg) {
+  ReadChunk* chunk = arg;
+  Object* o = ReaderRead(chunk->ctx, chunk->ctx->reader);
+  while(o) {
+    if(chunk->nForms == chunk->formListSize) {
+      unsigned int newSize = chunk->formListSize ? chunk->formListSize * 2 : 1024;
+      Object** newForms = (Object**)realloc(chunk->forms, sizeof(Object*) * newSize);
+      if(!newForms) {
+        abort(); // TODO: return error
+      }
+      chunk->formListSize = newSize;
+      chunk->forms = newForms;
+    }
+    chunk->forms[chunk->nForms++] = o;
+    o = ReaderRead(chunk->ctx, chunk->ctx->reader);
+  }
+  return NULL;
+}
+
+// Finds up to nChunks - 1 places to split text at so that every piece holds
+// whole top level forms, roughly evenly sized. Splits are only made on
+// whitespace outside of any list. Returns the number of pieces; splits holds
+// the end of each piece.
+static unsigned int findSplits(const char* text, unsigned long long size, unsigned int nChunks,
+                               unsigned long long* splits) {
+  unsigned int nSplits = 0;
+  unsigned long long depth = 0;
+  unsigned long long target = size / nChunks;
+  for(unsigned long long i = 0; i < size && nSplits < nChunks - 1; ++i) {
+    char c = text[i];
+    if(c == '(') {
+      ++depth;
+    }
+    else if(c == ')') {
+      if(depth > 0) {
+        --depth;
+      }
+    }
+    else if(depth == 0 && i >= target && (c == ' ' || c == '\n' || c == '\r' || c == '\t')) {
+      splits[nSplits++] = i;
+      target = i + (size - i) / (nChunks - nSplits);
+    }
+  }
+  splits[nSplits++] = size;
+  return nSplits;
+}
+
+// Reads all forms of a file on up to nThreads threads. The file is mapped,
+// split at top level form boundaries, and every piece is read by its own
+// context, so each thread allocates from its own heap. The contexts are owned
+// by the runtime and keep the forms alive. Returns the forms in source order,
+// to be freed by the caller, or NULL on failure.
+static Object** ReadParallel(Runtime* rt, const char* fileName, unsigned int nThreads,
+                             char intern, unsigned int* nForms) {
+  Stream* source = StreamNew(ST_MAPPED, fileName);
+  if(!source) {
+    return NULL;
+  }
+  // Binary input can not be split on text boundaries.
+  if(StreamSkipPrefix(source, CACHE_MAGIC, CACHE_MAGIC_SIZE) ||
+     StreamSkipPrefix(source, BINARY_MAGIC, BINARY_MAGIC_SIZE)) {
+    nThreads = 1;
+  }
+  source->mappedPos = 0;
+
+  unsigned long long* splits = malloc(sizeof(unsigned long long) * nThreads);
+  ReadChunk* chunks = calloc(nThreads, sizeof(ReadChunk));
+  pthread_t* threads = malloc(sizeof(pthread_t) * nThreads);
+  Object** forms = NULL;
+  unsigned int nChunks = 0;
+  if(!splits || !chunks || !threads) {
+    goto cleanup;
+  }
+
+  nChunks = findSplits(source->mapped, source->mappedSize, nThreads, splits);
+  for(unsigned int i = 0; i < nChunks; ++i) {
+    unsigned long long start = i == 0 ? 0 : splits[i - 1];
+    chunks[i].ctx = ContextNew(rt, ST_STRING, "");
+    if(!chunks[i].ctx) {
+      goto cleanup;
+    }
+    if(!RuntimeAddContext(rt, chunks[i].ctx)) {
+      ContextDelete(chunks[i].ctx);
+      chunks[i].ctx = NULL;
+      goto cleanup;
+    }
+    chunks[i].ctx->reader->intern = intern;
+    if(!ReaderSetMemory(chunks[i].ctx->reader, source->mapped + start, splits[i] - start)) {
+      goto cleanup;
+    }
+  }
+
+  for(unsigned int i = 1; i < nChunks; ++i) {
+    if(pthread_create(&threads[i], NULL, readChunk, &chunks[i]) != 0) {
+      abort(); // TODO: return error
+    }
+  }
+  readChunk(&chunks[0]);
+  for(unsigned int i = 1; i < nChunks; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  *nForms = 0;
+  for(unsigned int i = 0; i < nChunks; ++i) {
+    *nForms += chunks[i].nForms;
+  }
+  forms = malloc(sizeof(Object*) * (*nForms + 1));
+  if(forms) {
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < nChunks; ++i) {
+      if(chunks[i].nForms) {
+        memcpy(forms + n, chunks[i].forms, sizeof(Object*) * chunks[i].nForms);
+        n += chunks[i].nForms;
+      }
+    }
+  }
+
+ cleanup:
+  // The readers only hold on to the mapping until here.
+  for(unsigned int i = 0; chunks && i < nChunks; ++i) {
+    if(chunks[i].ctx) {
+      ReaderReset(chunks[i].ctx->reader, "");
+    }
+    free(chunks[i].forms);
+  }
+  StreamDelete(source);
+  free(splits);
+  free(chunks);
+  free(threads);
+  return forms;
+}
+
+// Reads every form from the context's reader and writes it, unevaluated, to
+// the context's writer in the binary format.
+static int convertToBinary(Context* ctx, const char* outFileName) {
+  ctx->writer = WriterNew(outFileName, NULL);
+  if(!ctx->writer) {
+    fputs("Could not open output file.\n", stderr);
+    return -1;
+  }
+  HeapMark mark;
+  HeapMarkSet(ctx, ctx->reader, &mark);
+  Object* o = ReaderRead(ctx, ctx->reader);
+  while(o) {
+    fWrite.fn1(ctx, o);
+    if(HeapRewindForm(ctx, ctx->reader, &mark) == 0) {
+      HeapMarkSet(ctx, ctx->reader, &mark);
+    }
+    o = ReaderRead(ctx, ctx->reader);
+  }
+  return 0;
+}
+
 int main(int argc, char* argv[]) {
-  if(argc < 2) {
+  // Options:
+  //   -i    share one object between identical literals in the input
+  //   -j N  read the program on N threads, bypassing the module cache
+  //   -e S  evaluate the forms in S before the program, which is then
+  //         optional. Every -e gets a fresh context from the runtime's pool.
+  int arg = 1;
+  char intern = 0;
+  unsigned int nThreads = 0;
+  unsigned int nExprs = 0;
+  const char** exprs = malloc(sizeof(char*) * argc);
+  if(!exprs) {
+    return -1;
+  }
+  while(arg < argc && argv[arg][0] == '-' && strcmp(argv[arg], "-w") != 0) {
+    if(strcmp(argv[arg], "-i") == 0) {
+      intern = 1;
+    }
+    else if(strcmp(argv[arg], "-e") == 0 && arg + 1 < argc) {
+      exprs[nExprs++] = argv[++arg];
+    }
+    else if(strcmp(argv[arg], "-j") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+      nThreads = atoi(argv[++arg]);
+    }
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[arg]);
+      free(exprs);
+      return -1;
+    }
+    ++arg;
+  }
+
+  if(arg >= argc && nExprs == 0) {
     fputs("Give program please.\n", stderr);
+    free(exprs);
     return -1;
   }
-  Runtime* rt = RuntimeNew(ST_FILE, argv[1]);
+
+  // octarine -w <input> <output> converts a text file to the binary format.
+  if(arg < argc && strcmp(argv[arg], "-w") == 0) {
+    free(exprs);
+    if(argc - arg < 3) {
+      fputs("Usage: octarine -w <input> <output>\n", stderr);
+      return -1;
+    }
+    Runtime* rt = RuntimeNew(ST_FILE, argv[arg + 1]);
+    if(!rt) {
+      fputs("Could not open input file.\n", stderr);
+      return -1;
+    }
+    rt->currentContext->reader->intern = intern;
+    int result = convertToBinary(rt->currentContext, argv[arg + 2]);
+    RuntimeDelete(rt);
+    return result;
+  }
+
+  Runtime* rt = RuntimeNew(ST_STRING, "");
   if(!rt) {
-    fputs("Give program please.\n", stderr);
+    free(exprs);
     return -1;
   }
+  Object** forms = NULL;
+  unsigned int nForms = 0;
+  if(arg >= argc) {
+    rt->currentContext = NULL;
+  }
+  else if(nThreads) {
+    forms = ReadParallel(rt, argv[arg], nThreads, intern, &nForms);
+    if(!forms) {
+      fputs("Give program please.\n", stderr);
+      RuntimeDelete(rt);
+      free(exprs);
+      return -1;
+    }
+  }
+  else {
+    rt->currentContext = RuntimeLoad(rt, argv[arg]);
+    if(!rt->currentContext) {
+      fputs("Give program please.\n", stderr);
+      RuntimeDelete(rt);
+      free(exprs);
+      return -1;
+    }
+    rt->currentContext->reader->intern = intern;
+  }
 
 #ifdef DEBUG
   puts("octarine 0.0.1, debug build");
@@ -959,23 +4498,29 @@ int main(int argc, char* argv[]) {
 #error Must define DEBUG or RELEASE
 #endif
 
-  Context* ctx = rt->currentContext;
-  Reader* r = ctx->reader;
-  Object* o = ReaderRead(ctx, r);
-  while(o) {
-    if(o->type->evalFn && o->type->evalFn->isBuiltIn) {
-      StackPush(ctx->stack, o);
-      o = o->type->evalFn->builtIn(ctx);
-    }
-    if(!o) {
-      puts("nil");
+  for(unsigned int i = 0; i < nExprs; ++i) {
+    Context* ctx = RuntimeAcquireContext(rt, exprs[i]);
+    if(!ctx) {
+      fputs("Could not evaluate expression.\n", stderr);
+      RuntimeDelete(rt);
+      free(exprs);
+      return -1;
     }
-    else if(o->type->printFn && o->type->printFn->isBuiltIn) {
-      StackPush(ctx->stack, o);
-      o->type->printFn->builtIn(ctx);
-      putc('\n', stdout);
+    ctx->reader->intern = intern;
+    evalReader(ctx);
+    RuntimeReleaseContext(rt, ctx);
+  }
+  free(exprs);
+
+  Context* ctx = rt->currentContext;
+  if(forms) {
+    for(unsigned int i = 0; i < nForms; ++i) {
+      evalPrint(ctx, forms[i]);
     }
-    o = ReaderRead(ctx, r);
+    free(forms);
+  }
+  else if(ctx) {
+    evalReader(ctx);
   }
 
   RuntimeDelete(rt);